@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#include "common.hh"
+#include "level.hh"
+#include "journal.hh"
+#include <stdio.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#include <sys/stat.h>
+#endif
+namespace rsgame {
+/* Write-ahead journal
+ * Every set_tile is appended to the journal as an 8 byte record: the
+ * pos_to_index value, id<<4 | meta, and two bytes of padding. At the end of
+ * a tick the pending records get a tick marker (0xFFFFFFFF, tick - base
+ * tick) and are handed to the writer thread, which appends them and does a
+ * single fsync for the whole batch.
+ *
+ * A checkpoint snapshots the sections modified since the previous one,
+ * starts a new journal generation, and lets the writer thread fold the
+ * snapshot into the world file in place. The world header is pointed at the
+ * new generation only after the section data is synced, and only then is
+ * the old journal deleted, or on the next start if it crashed before that.
+ * The writer thread also encodes the sections, from copies the checkpoint
+ * takes. A section goes back into its record if it still fits the same
+ * size class, and into a free record of its new class or onto the end of
+ * the records otherwise. Records that were freed by a checkpoint are not
+ * reused until it is complete, so a crash at any point leaves every
+ * section either old or new, with the journal covering all the
+ * differences.
+ *
+ * Level snapshots keep reading unmodified sections out of the mapping of
+ * the world file as it was loaded. While one is alive, a section that is
+ * still in the record it was loaded from is written to a new record instead
+ * of in place, and the old record is held back until a checkpoint finds no
+ * snapshot left.
+ *
+ * Recovery replays every journal starting at the generation in the world
+ * header, each up to its last tick marker. Scheduled updates are restored
+ * from the header of the last journal, and torches touched by the replay are
+ * rescheduled so that clocks keep running.
+ *
+ * Journal header:
+ *    0  char[8]  magic "RSGJRNL\0"
+ *    8  u32      generation
+ *   12  u32      number of scheduled updates
+ *   16  i64      base tick
+ *   24           scheduled updates at the start of the generation
+ */
+enum {
+	JOURNAL_HEADER = 24,
+	JOURNAL_RECORD = 8,
+};
+#ifndef WIN32
+static int file_open(const char *path, bool create) {
+	return ::open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+}
+static bool file_write(int fd, uint64_t off, const void *buf, size_t len) {
+	const uint8_t *p = (const uint8_t *)buf;
+	while (len) {
+		ssize_t r = pwrite(fd, p, len, off);
+		if (r <= 0)
+			return false;
+		p += r;
+		off += r;
+		len -= r;
+	}
+	return true;
+}
+static bool file_sync(int fd) {
+	return fsync(fd) == 0;
+}
+static void file_close(int fd) {
+	::close(fd);
+}
+#else
+static int file_open(const char *path, bool create) {
+	return _open(path, _O_RDWR | _O_BINARY | (create ? _O_CREAT | _O_TRUNC : 0), _S_IREAD | _S_IWRITE);
+}
+static bool file_write(int fd, uint64_t off, const void *buf, size_t len) {
+	const uint8_t *p = (const uint8_t *)buf;
+	if (_lseeki64(fd, off, SEEK_SET) == -1)
+		return false;
+	while (len) {
+		int r = _write(fd, p, len);
+		if (r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+static bool file_sync(int fd) {
+	return _commit(fd) == 0;
+}
+static void file_close(int fd) {
+	_close(fd);
+}
+#endif
+static bool read_file(const char *path, std::vector<uint8_t> &out) {
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	uint8_t buf[65536];
+	size_t r;
+	out.clear();
+	while ((r = fread(buf, 1, sizeof(buf), f)))
+		out.insert(out.end(), buf, buf + r);
+	fclose(f);
+	return true;
+}
+Journal::Journal(Level *level, const char *world_path) :level(level), world_path(world_path) {}
+Journal::~Journal() {
+	if (writer.joinable())
+		close();
+}
+void Journal::journal_path(char *out, size_t len, uint32_t gen) {
+	snprintf(out, len, "%s.journal.%u", world_path, gen);
+}
+void Journal::journal_header(std::vector<uint8_t> &out, uint32_t gen) {
+	std::vector<ScheduledUpdate> sched = level->get_scheduled_updates();
+	out.assign(JOURNAL_HEADER + sched.size()*REGION_SCHED, 0);
+	memcpy(&out[0], "RSGJRNL", 8);
+	put_le32(&out[8], gen);
+	put_le32(&out[12], sched.size());
+	put_le64(&out[16], base_tick);
+	for (size_t i = 0; i < sched.size(); i++) {
+		auto &u = sched[i];
+		put_sched(&out[JOURNAL_HEADER + i*REGION_SCHED], u.index, u.id, u.target_tick);
+	}
+}
+bool Journal::replay(uint32_t gen, std::vector<ivec3> &touched) {
+	char path[4096];
+	journal_path(path, sizeof(path), gen);
+	std::vector<uint8_t> buf;
+	if (!read_file(path, buf))
+		return false;
+	if (buf.size() < JOURNAL_HEADER || memcmp(&buf[0], "RSGJRNL", 8) || get_le32(&buf[8]) != gen) {
+		fprintf(stderr, "%s: bad journal header, skipping\n", path);
+		return true;
+	}
+	uint32_t nsched = get_le32(&buf[12]);
+	long base = get_le64(&buf[16]);
+	size_t start = JOURNAL_HEADER + (size_t)nsched*REGION_SCHED;
+	if (buf.size() < start) {
+		fprintf(stderr, "%s: bad journal header, skipping\n", path);
+		return true;
+	}
+	level->tick = base;
+	level->clear_scheduled_updates();
+	for (uint32_t i = 0; i < nsched; i++) {
+		const uint8_t *r = &buf[JOURNAL_HEADER + i*REGION_SCHED];
+		level->restore_scheduled_update(get_le32(r), r[4], get_le64(r+8));
+	}
+	// only whole ticks are replayed
+	size_t end = start;
+	for (size_t p = start; p + JOURNAL_RECORD <= buf.size(); p += JOURNAL_RECORD)
+		if (get_le32(&buf[p]) == 0xFFFFFFFF)
+			end = p + JOURNAL_RECORD;
+	size_t count = 0;
+	for (size_t p = start; p < end; p += JOURNAL_RECORD) {
+		uint32_t index = get_le32(&buf[p]);
+		if (index == 0xFFFFFFFF) {
+			level->tick = base + get_le32(&buf[p+4]);
+			continue;
+		}
+		ivec3 pos = level->index_to_pos(index);
+		uint16_t v = buf[p+4] | buf[p+5] << 8;
+		level->set_tile(pos.x, pos.y, pos.z, v >> 4, v & 15);
+		if (pos.x >= 0) {
+			uint32_t s = &level->section_at(pos.x, pos.y, pos.z) - level->sections.data();
+			if (!section_dirty[s]) {
+				section_dirty[s] = true;
+				dirty_sections.push_back(s);
+			}
+		}
+		touched.push_back(pos);
+		count++;
+	}
+	fprintf(stderr, "%s: replayed %zu changes\n", path, count);
+	return true;
+}
+bool Journal::open() {
+	std::vector<uint8_t> head;
+	size_t nsections = level->sections.size();
+	data_offset = region_data_offset(nsections);
+	{
+		FILE *f = fopen(world_path, "rb");
+		if (!f) {
+			perror(world_path);
+			return false;
+		}
+		head.resize(REGION_HEADER + nsections*4);
+		size_t r = fread(head.data(), 1, head.size(), f);
+		fclose(f);
+		if (r != head.size()) {
+			fprintf(stderr, "%s: truncated\n", world_path);
+			return false;
+		}
+	}
+	if (get_le32(&head[8]) != REGION_VERSION) {
+		fprintf(stderr, "%s: journals need a version %u world file\n", world_path, REGION_VERSION);
+		return false;
+	}
+	oldest_generation = generation = get_le32(&head[40]);
+	nunits = get_le32(&head[32]);
+	index.resize(nsections);
+	// what's between the records is free, in the largest classes that fit
+	std::vector<std::pair<uint32_t, uint32_t>> used;
+	for (size_t i = 0; i < nsections; i++) {
+		uint32_t e = index[i] = get_le32(&head[REGION_HEADER + i*4]);
+		if (e && !(e & 0x80000000))
+			used.emplace_back(region_entry_unit(e), region_class_units[region_entry_class(e)]);
+	}
+	std::sort(used.begin(), used.end());
+	uint32_t unit = 0;
+	used.emplace_back(nunits, 0);
+	for (auto &u : used) {
+		while (unit < u.first) {
+			int c = REGION_CLASSES - 1;
+			while (region_class_units[c] > u.first - unit)
+				c--;
+			free_records[c].push_back(region_entry(c, unit));
+			unit += region_class_units[c];
+		}
+		unit = std::max(unit, u.first + u.second);
+	}
+	section_dirty.assign(nsections, false);
+	mapped_index = index;
+
+	// a crash between a checkpoint's header write and its remove()s
+	// leaves the journals just below the header's generation, which
+	// never get replayed. They're removed oldest first, so what's left
+	// ends right below it
+	for (uint32_t gen = generation; gen-- > 0;) {
+		char path[4096];
+		journal_path(path, sizeof(path), gen);
+		if (remove(path) != 0)
+			break;
+	}
+	std::vector<ivec3> touched;
+	while (replay(generation, touched))
+		generation++;
+	for (auto pos : touched) {
+		uint8_t id = level->get_tile_id(pos.x, pos.y, pos.z);
+		if (id == 75 || id == 76)
+			level->schedule_update(pos.x, pos.y, pos.z, level->tick+2);
+	}
+
+	char path[4096];
+	journal_path(path, sizeof(path), generation);
+	journal_fd = file_open(path, true);
+	if (journal_fd == -1) {
+		perror(path);
+		return false;
+	}
+	world_fd = file_open(world_path, false);
+	if (world_fd == -1) {
+		perror(world_path);
+		return false;
+	}
+	base_tick = level->tick;
+	std::vector<uint8_t> jhead;
+	journal_header(jhead, generation);
+	if (!file_write(journal_fd, 0, jhead.data(), jhead.size()) || !file_sync(journal_fd)) {
+		perror(path);
+		return false;
+	}
+	journal_size = jhead.size();
+	level->journal = this;
+	writer = std::thread(&Journal::run, this);
+	return true;
+}
+void Journal::push(Job &&job) {
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		jobs.push_back(std::move(job));
+	}
+	jobs_cv.notify_one();
+}
+void Journal::end_tick() {
+	if (pending.empty())
+		return;
+	size_t n = pending.size();
+	pending.resize(n + 8);
+	put_le32(&pending[n], 0xFFFFFFFF);
+	put_le32(&pending[n+4], level->tick - base_tick);
+	Job job;
+	job.type = Job::APPEND;
+	job.data = std::move(pending);
+	pending.clear();
+	push(std::move(job));
+}
+void Journal::checkpoint() {
+	end_tick();
+	Job job;
+	job.type = Job::CHECKPOINT;
+	job.generation = ++generation;
+	job.tick = level->tick;
+	for (uint32_t s : dirty_sections) {
+		section_dirty[s] = false;
+		uint16_t v;
+		job.sections.push_back(s);
+		if (level->sections[s].is_uniform(v)) {
+			job.entries.push_back(v ? 0x80000000 | v : 0);
+		} else {
+			job.entries.push_back(1);
+			job.copies.push_back(level->sections[s]);
+		}
+	}
+	dirty_sections.clear();
+	std::vector<ScheduledUpdate> sched = level->get_scheduled_updates();
+	job.sched.resize(sched.size()*REGION_SCHED);
+	for (size_t i = 0; i < sched.size(); i++) {
+		auto &u = sched[i];
+		put_sched(&job.sched[i*REGION_SCHED], u.index, u.id, u.target_tick);
+	}
+	base_tick = level->tick;
+	Job rotate;
+	rotate.type = Job::ROTATE;
+	rotate.generation = generation;
+	journal_header(rotate.data, generation);
+	push(std::move(rotate));
+	push(std::move(job));
+}
+void Journal::close() {
+	checkpoint();
+	Job job;
+	job.type = Job::QUIT;
+	push(std::move(job));
+	writer.join();
+	level->journal = nullptr;
+	file_close(journal_fd);
+	file_close(world_fd);
+}
+void Journal::run() {
+	for (;;) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(jobs_mutex);
+			jobs_cv.wait(lock, [this]{ return !jobs.empty(); });
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		switch (job.type) {
+		case Job::APPEND:
+			if (!file_write(journal_fd, journal_size, job.data.data(), job.data.size()) || !file_sync(journal_fd))
+				perror("journal write");
+			journal_size += job.data.size();
+			break;
+		case Job::ROTATE: {
+			char path[4096];
+			journal_path(path, sizeof(path), job.generation);
+			file_close(journal_fd);
+			journal_fd = file_open(path, true);
+			if (journal_fd == -1 || !file_write(journal_fd, 0, job.data.data(), job.data.size()) || !file_sync(journal_fd))
+				perror(path);
+			journal_size = job.data.size();
+			break;
+		}
+		case Job::CHECKPOINT:
+			do_checkpoint(job);
+			break;
+		case Job::QUIT:
+			return;
+		}
+	}
+}
+void Journal::do_checkpoint(Job &job) {
+	// snapshots taken from now on don't map the sections in this job,
+	// they were all modified before it was made
+	bool snapshots = level->mapping.use_count() > 1;
+	const Section *copy = job.copies.data();
+	std::vector<uint8_t> record;
+	for (size_t i = 0; i < job.sections.size(); i++) {
+		uint32_t s = job.sections[i];
+		uint32_t old = index[s];
+		uint32_t old_record = old & 0x80000000 ? 0 : old;
+		if (old_record && old_record == mapped_index[s] && snapshots) {
+			held_records.push_back(old_record);
+			old_record = 0;
+		}
+		mapped_index[s] = 0;
+		if (job.entries[i] == 1) {
+			record.clear();
+			(copy++)->encode(record);
+			int c = region_class(record.size());
+			uint32_t e = old_record;
+			if (!e || region_entry_class(e) != c) {
+				if (!free_records[c].empty()) {
+					e = free_records[c].back();
+					free_records[c].pop_back();
+				} else if (nunits + region_class_units[c] <= REGION_MAX_UNITS) {
+					e = region_entry(c, nunits);
+					nunits += region_class_units[c];
+				} else {
+					// the header stays where it is, so the journals
+					// still cover this section
+					fprintf(stderr, "%s: no room left for sections\n", world_path);
+					full = true;
+					continue;
+				}
+				if (old_record)
+					freed_records.push_back(old_record);
+			}
+			if (!file_write(world_fd, data_offset + (uint64_t)region_entry_unit(e)*REGION_UNIT, record.data(), record.size()))
+				perror("checkpoint write");
+			index[s] = e;
+		} else {
+			if (old_record)
+				freed_records.push_back(old_record);
+			index[s] = job.entries[i];
+		}
+	}
+	if (full)
+		return;
+	if (!file_write(world_fd, data_offset + (uint64_t)nunits*REGION_UNIT, job.sched.data(), job.sched.size()) ||
+			!file_sync(world_fd))
+		perror("checkpoint write");
+	std::vector<uint8_t> head(REGION_HEADER + index.size()*4 - 24);
+	put_le64(&head[0], job.tick);
+	put_le32(&head[8], nunits);
+	put_le32(&head[12], job.sched.size()/REGION_SCHED);
+	put_le32(&head[16], job.generation);
+	for (size_t i = 0; i < index.size(); i++)
+		put_le32(&head[REGION_HEADER - 24 + i*4], index[i]);
+	if (!file_write(world_fd, 24, head.data(), head.size()) || !file_sync(world_fd)) {
+		perror("checkpoint write");
+		return;
+	}
+	for (; oldest_generation < job.generation; oldest_generation++) {
+		char path[4096];
+		journal_path(path, sizeof(path), oldest_generation);
+		remove(path);
+	}
+	for (uint32_t e : freed_records)
+		free_records[region_entry_class(e)].push_back(e);
+	freed_records.clear();
+	if (level->mapping.use_count() <= 1) {
+		for (uint32_t e : held_records)
+			free_records[region_entry_class(e)].push_back(e);
+		held_records.clear();
+	}
+}
+}
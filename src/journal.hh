@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#ifndef RSGAME_JOURNAL
+#define RSGAME_JOURNAL
+#include "region.hh"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+namespace rsgame {
+	struct Level;
+	struct Section;
+	struct Journal {
+		Journal(Level *level, const char *world_path);
+		~Journal();
+		Journal(const Journal&) =delete;
+		Journal &operator=(const Journal&) =delete;
+		bool open();
+		void log(uint32_t index, uint16_t value, uint32_t section) {
+			size_t n = pending.size();
+			pending.resize(n + 8);
+			put_le32(&pending[n], index);
+			pending[n+4] = value;
+			pending[n+5] = value >> 8;
+			pending[n+6] = pending[n+7] = 0;
+			if (!section_dirty[section]) {
+				section_dirty[section] = true;
+				dirty_sections.push_back(section);
+			}
+			mutations++;
+		}
+		void end_tick();
+		void checkpoint();
+		void close();
+		uint64_t mutations = 0;
+	private:
+		Level *level;
+		const char *world_path;
+		uint32_t generation = 0;
+		long base_tick = 0;
+		std::vector<uint8_t> pending;
+		std::vector<bool> section_dirty;
+		std::vector<uint32_t> dirty_sections;
+		struct Job {
+			enum { APPEND, ROTATE, CHECKPOINT, QUIT } type;
+			uint32_t generation;
+			long tick;
+			std::vector<uint8_t> data;
+			std::vector<uint32_t> sections;
+			std::vector<uint32_t> entries;
+			std::vector<Section> copies;
+			std::vector<uint8_t> sched;
+		};
+		std::deque<Job> jobs;
+		std::mutex jobs_mutex;
+		std::condition_variable jobs_cv;
+		std::thread writer;
+		void push(Job &&job);
+		void run();
+		void do_checkpoint(Job &job);
+		void journal_header(std::vector<uint8_t> &out, uint32_t gen);
+		void journal_path(char *out, size_t len, uint32_t gen);
+		bool replay(uint32_t gen, std::vector<ivec3> &touched);
+		// owned by the writer thread once it's started
+		int world_fd = -1, journal_fd = -1;
+		uint64_t journal_size = 0;
+		uint32_t oldest_generation = 0;
+		size_t data_offset = 0;
+		std::vector<uint32_t> index;
+		uint32_t nunits = 0;
+		// free records of each size class, and the ones that can't be
+		// reused yet, see journal.cc
+		std::vector<uint32_t> free_records[REGION_CLASSES];
+		std::vector<uint32_t> freed_records, held_records;
+		// set once a checkpoint couldn't find room for a section, after
+		// which the world file isn't pointed at newer journals
+		bool full = false;
+		// the record each section was loaded from, until it's checkpointed
+		std::vector<uint32_t> mapped_index;
+	};
+}
+#endif
@@ -1,9 +1,14 @@
 // SPDX-License-Identifier: Apache-2.0 OR MIT
 #include "common.hh"
 #include "level.hh"
+#include "journal.hh"
 #ifndef RSGAME_SERVER
 #include "render.hh"
 #endif
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 namespace rsgame {
 #ifdef RSGAME_SERVER
 void server_set_dirty(int x, int y, int z);
@@ -13,13 +18,46 @@ struct RenderLevel {
 	}
 };
 #endif
+// worker threads for parallel ticks, see run_islands
+struct Level::SimPool {
+	std::vector<std::unique_ptr<Sim>> sims;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable start_cv, done_cv;
+	unsigned generation = 0, done = 0;
+	bool quit = false;
+	// batch positions of the updates in each island
+	std::vector<std::vector<uint32_t>> islands;
+	std::atomic<size_t> next_island;
+	std::atomic<bool> conflict;
+	unsigned serial_ticks = 0;
+	std::vector<uint32_t> claimed;
+	// sections with updates in them, to their group
+	FlatMap section_groups;
+	std::vector<uint32_t> group_parent, group_islands, batch_groups;
+	std::vector<ivec3> group_sections;
+	std::vector<SimEffect> effects;
+	~SimPool();
+};
+Level::SimPool::~SimPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	start_cv.notify_all();
+	for (auto &t : threads)
+		t.join();
+}
+thread_local Level::Sim *Level::worker_sim = nullptr;
+Level::~Level() {
+}
 Level::Level(int xs, int zs, int zb) {
 	xsize = xs;
 	zsize = zs;
 	zbits = zb;
-	buf.resize(xsize*zsize*128*3/2);
-	blocks = buf.data();
-	data = buf.data() + xsize*zsize*128;
+	xsections = (xsize + 15) >> 4;
+	zsections = (zsize + 15) >> 4;
+	sections.resize(xsections*zsections*8);
 	set_tile(0, 0, 0, 0, 0);
 	set_tile(0, 0, 1, 1, 0);
 	set_tile(1, 0, 1, 2, 0);
@@ -128,26 +166,547 @@ ivec3 Level::index_to_pos(uint32_t index) {
 		return ivec3(-1);
 	return ivec3(index >> (zbits+7), index & 127, index >> 7 & ((1 << zbits)-1));
 }
+// owner of a section claimed by more than one island
+static const uint32_t CONTESTED = (uint32_t)-1;
+// whether the island the current worker is running can use a section,
+// which is its own or one nobody claimed, as long as it doesn't write
+// to it. anything else falls back to a serial tick
+bool Level::may_access(const Section &s, bool write) {
+	uint32_t owner = section_owner[&s - sections.data()];
+	if (owner == worker_sim->island || (!owner && !write))
+		return true;
+	pool->conflict = true;
+	return false;
+}
 uint8_t Level::get_tile_id(int x, int y, int z) {
+#ifdef RSGAME_STATS
+	if (worker_sim)
+		worker_sim->tile_reads++;
+	else
+		tile_reads++;
+#endif
 	if (x < 0 || x > xsize-1 || z < 0 || z > zsize-1 || y < 0 || y > 127)
 		return 0;
-	return blocks[x << (zbits+7) | z << 7 | y];
+	Section &s = section_at(x, y, z);
+	if (worker_sim && !may_access(s, false))
+		return 0;
+	return s.get((x&15) << 8 | (z&15) << 4 | (y&15)) >> 4;
 }
 uint8_t Level::get_tile_meta(int x, int y, int z) {
 	if (x < 0 || x > xsize-1 || z < 0 || z > zsize-1 || y < 0 || y > 127)
 		return 0;
-	return data[x << (zbits+6) | z << 6 | y >> 1]>>(y<<2 & 4) & 15;
+	Section &s = section_at(x, y, z);
+	if (worker_sim && !may_access(s, false))
+		return 0;
+	return s.get((x&15) << 8 | (z&15) << 4 | (y&15)) & 15;
 }
+#ifndef RSGAME_NETCLIENT
+static bool reacts_to_updates(uint8_t id) {
+	return id == 50 || id == 55 || id == 75 || id == 76;
+}
+// whether swapping one for the other leaves wire connections alone,
+// like a torch turning on or off
+static bool same_wire_shape(uint8_t a, uint8_t b) {
+	return (a == 55) == (b == 55) && tiles::is_opaque[a] == tiles::is_opaque[b]
+		&& tiles::is_power_source[a] == tiles::is_power_source[b]
+		&& reacts_to_updates(a) == reacts_to_updates(b);
+}
+#endif
 void Level::set_tile(int x, int y, int z, uint8_t id, uint8_t metadata) {
 	if (x < 0 || x > xsize-1 || z < 0 || z > zsize-1 || y < 0 || y > 127 || metadata > 15)
 		return;
-	int idx = x << (zbits+7) | z << 7 | y;
-	blocks[idx] = id;
-	uint8_t &meta = data[idx>>1];
-	if (y&1)
-		meta = meta&0x0F | metadata<<4;
-	else
-		meta = meta&0xF0 | metadata;
+	Section &s = section_at(x, y, z);
+	int i = (x&15) << 8 | (z&15) << 4 | (y&15);
+#ifndef RSGAME_NETCLIENT
+	if (Sim *w = worker_sim) {
+		// another island may be writing the section, so it isn't
+		// even read before this
+		if (!may_access(s, true))
+			return;
+		uint16_t old_value = s.get(i);
+		// the other workers' caches get fixed up in merge_effects
+		if (old_value >> 4 != id)
+			forget_wire_infos(*w, x, y, z, same_wire_shape(old_value >> 4, id));
+		w->count_write();
+		w->effects.push_back({SimEffect::SET, w->number, old_value, (uint16_t)(id << 4 | metadata),
+			w->batch_pos, (uint32_t)(x << (zbits+7) | z << 7 | y), 0});
+		s.set(i, id << 4 | metadata);
+		return;
+	}
+	main_sim.count_write();
+	uint16_t old_value = s.get(i);
+	if (old_value >> 4 != id) {
+		bool power_only = same_wire_shape(old_value >> 4, id);
+		forget_wire_infos(main_sim, x, y, z, power_only);
+		if (pool)
+			for (auto &w : pool->sims)
+				forget_wire_infos(*w, x, y, z, power_only);
+	}
+#endif
+	s.set(i, id << 4 | metadata);
+	if (journal)
+		journal->log(x << (zbits+7) | z << 7 | y, id << 4 | metadata, &s - sections.data());
+}
+size_t Level::flat_size() {
+	return (size_t)xsize*zsize*128*3/2;
+}
+void Level::read_flat(size_t pos, uint8_t *out, size_t len) {
+	size_t nblocks = (size_t)xsize*zsize*128;
+	for (; len; pos++, len--) {
+		if (pos < nblocks) {
+			*out++ = get_tile_id(pos >> (zbits+7), pos & 127, pos >> 7 & ((1 << zbits)-1));
+		} else {
+			size_t i = (pos - nblocks) << 1;
+			int x = i >> (zbits+7), y = i & 127, z = i >> 7 & ((1 << zbits)-1);
+			*out++ = get_tile_meta(x, y, z) | get_tile_meta(x, y+1, z) << 4;
+		}
+	}
+}
+std::shared_ptr<const Level::Snapshot> Level::snapshot() {
+	std::shared_ptr<Snapshot> snap = std::make_shared<Snapshot>();
+	snap->xsize = xsize;
+	snap->zsize = zsize;
+	snap->zbits = zbits;
+	snap->zsections = zsections;
+	snap->sections = sections;
+#ifndef WIN32
+	// the journal doesn't overwrite mapped records while this is shared
+	snap->mapping = mapping;
+#else
+	// a mapped file can't be replaced on Windows, and save would have
+	// to while the snapshot holds on to the mapping
+	for (auto &s : snap->sections)
+		s.unmap();
+#endif
+	return snap;
+}
+size_t Level::Snapshot::flat_size() const {
+	return (size_t)xsize*zsize*128*3/2;
+}
+void Level::Snapshot::read_flat(size_t pos, uint8_t *out, size_t len) const {
+	size_t nblocks = (size_t)xsize*zsize*128;
+	for (; len; pos++, len--) {
+		if (pos < nblocks) {
+			*out++ = get(pos >> (zbits+7), pos & 127, pos >> 7 & ((1 << zbits)-1)) >> 4;
+		} else {
+			size_t i = (pos - nblocks) << 1;
+			int x = i >> (zbits+7), y = i & 127, z = i >> 7 & ((1 << zbits)-1);
+			*out++ = (get(x, y, z) & 15) | (get(x, y+1, z) & 15) << 4;
+		}
+	}
+}
+void Level::Snapshot::encode_sections(size_t first, size_t count, std::vector<uint8_t> &out) const {
+	for (size_t i = first; i < first + count; i++)
+		sections[i].encode(out);
+}
+bool Level::decode_sections(size_t first, size_t count, const uint8_t *in, size_t len) {
+	if (first + count > sections.size())
+		return false;
+	for (size_t i = first; i < first + count; i++) {
+		size_t used = sections[i].decode(in, len);
+		if (!used)
+			return false;
+		in += used;
+		len -= used;
+	}
+	return !len;
+}
+void Level::write_flat(size_t pos, const uint8_t *in, size_t len) {
+	size_t nblocks = (size_t)xsize*zsize*128;
+	for (; len; pos++, len--) {
+		if (pos < nblocks) {
+			int x = pos >> (zbits+7), y = pos & 127, z = pos >> 7 & ((1 << zbits)-1);
+			set_tile(x, y, z, *in++, get_tile_meta(x, y, z));
+		} else {
+			size_t i = (pos - nblocks) << 1;
+			int x = i >> (zbits+7), y = i & 127, z = i >> 7 & ((1 << zbits)-1);
+			set_tile(x, y, z, get_tile_id(x, y, z), *in & 15);
+			set_tile(x, y+1, z, get_tile_id(x, y+1, z), *in++ >> 4);
+		}
+	}
+}
+size_t Level::memory_usage() {
+	size_t total = sizeof(*this) + sections.capacity()*sizeof(Section);
+	for (auto &s : sections)
+		total += s.memory_usage() - sizeof(Section);
+	return total;
+}
+void Section::set(int i, uint16_t v) {
+	if (mapped) {
+		// copy on write
+		if (get(i) == v)
+			return;
+		load_raw(mapped);
+	}
+	if (!bpe) {
+		if (!bits.empty()) {
+			uint8_t *raw = (uint8_t *)bits.data();
+			raw[i] = v >> 4;
+			uint8_t &meta = raw[4096 + (i >> 1)];
+			if (i&1)
+				meta = meta&0x0F | (v&15)<<4;
+			else
+				meta = meta&0xF0 | (v&15);
+			return;
+		}
+		uint16_t u = palette.empty() ? 0 : palette[0] & 0xFFFF;
+		if (u == v)
+			return;
+		palette = {u | 4096u << 16};
+		bits.assign(4096/64, 0);
+		bpe = 1;
+	}
+	int old = bits[i*bpe >> 6] >> (i*bpe & 63) & ((1 << bpe) - 1);
+	if ((palette[old] & 0xFFFF) == v)
+		return;
+	int index = -1, unused = -1;
+	for (size_t j = 0; j < palette.size(); j++) {
+		if ((palette[j] & 0xFFFF) == v) {
+			index = j;
+			break;
+		}
+		if (unused == -1 && palette[j] >> 16 == 0)
+			unused = j;
+	}
+	if (index == -1) {
+		if (unused != -1) {
+			index = unused;
+			palette[index] = v;
+		} else {
+			if (palette.size() == 1u << bpe) {
+				if (bpe == 8) {
+					make_direct();
+					set(i, v);
+					return;
+				}
+				repack(bpe*2);
+			}
+			index = palette.size();
+			palette.push_back(v);
+		}
+	}
+	palette[old] -= 1 << 16;
+	palette[index] += 1 << 16;
+	put(i, index);
+	if (palette[index] >> 16 == 4096) {
+		// the whole section is a single block now
+		palette = v ? std::vector<uint32_t>{v} : std::vector<uint32_t>();
+		bits = std::vector<uint64_t>();
+		bpe = 0;
+	}
+}
+void Section::put(int i, int index) {
+	uint64_t &w = bits[i*bpe >> 6];
+	int shift = i*bpe & 63;
+	w = w & ~((uint64_t)((1 << bpe) - 1) << shift) | (uint64_t)index << shift;
+}
+void Section::repack(int new_bpe) {
+	std::vector<uint64_t> old = std::move(bits);
+	int old_bpe = bpe;
+	bits.assign(4096*new_bpe/64, 0);
+	bpe = new_bpe;
+	for (int i = 0; i < 4096; i++)
+		put(i, old[i*old_bpe >> 6] >> (i*old_bpe & 63) & ((1 << old_bpe) - 1));
+}
+void Section::make_direct() {
+	std::vector<uint64_t> raw(6144/8);
+	uint8_t *p = (uint8_t *)raw.data();
+	for (int i = 0; i < 4096; i++) {
+		uint16_t v = get(i);
+		p[i] = v >> 4;
+		p[4096 + (i >> 1)] |= (v&15) << (i << 2 & 4);
+	}
+	bits = std::move(raw);
+	palette = std::vector<uint32_t>();
+	bpe = 0;
+}
+void Section::fill(uint16_t v) {
+	palette = v ? std::vector<uint32_t>{v} : std::vector<uint32_t>();
+	bits = std::vector<uint64_t>();
+	mapped = nullptr;
+	bpe = 0;
+}
+void Section::map(const uint8_t *raw) {
+	fill(0);
+	mapped = raw;
+}
+void Section::unmap() {
+	if (mapped)
+		load_raw(mapped);
+}
+bool Section::is_uniform(uint16_t &v) const {
+	if (bpe || !bits.empty() || mapped)
+		return false;
+	v = get(0);
+	return true;
+}
+void Section::write_raw(uint8_t *out) const {
+	if (!bpe && (mapped || !bits.empty())) {
+		memcpy(out, mapped ? mapped : (const uint8_t *)bits.data(), 6144);
+		return;
+	}
+	memset(out + 4096, 0, 2048);
+	for (int i = 0; i < 4096; i++) {
+		uint16_t v = get(i);
+		out[i] = v >> 4;
+		out[4096 + (i >> 1)] |= (v&15) << (i << 2 & 4);
+	}
+}
+void Section::load_raw(const uint8_t *raw) {
+	int16_t lookup[4096];
+	memset(lookup, -1, sizeof(lookup));
+	std::vector<uint32_t> pal;
+	for (int i = 0; i < 4096; i++) {
+		uint16_t v = raw[i] << 4 | raw[4096 + (i >> 1)] >> (i << 2 & 4) & 15;
+		if (lookup[v] == -1) {
+			if (pal.size() == 256) {
+				std::vector<uint64_t> copy(6144/8);
+				memcpy(copy.data(), raw, 6144);
+				fill(0);
+				bits = std::move(copy);
+				return;
+			}
+			lookup[v] = pal.size();
+			pal.push_back(v);
+		}
+		pal[lookup[v]] += 1 << 16;
+	}
+	if (pal.size() == 1) {
+		fill(pal[0] & 0xFFFF);
+		return;
+	}
+	int new_bpe = 1;
+	while (1u << new_bpe < pal.size())
+		new_bpe *= 2;
+	std::vector<uint64_t> packed(4096*new_bpe/64);
+	for (int i = 0; i < 4096; i++) {
+		uint16_t v = raw[i] << 4 | raw[4096 + (i >> 1)] >> (i << 2 & 4) & 15;
+		packed[i*new_bpe >> 6] |= (uint64_t)lookup[v] << (i*new_bpe & 63);
+	}
+	palette = std::move(pal);
+	bits = std::move(packed);
+	mapped = nullptr;
+	bpe = new_bpe;
+}
+size_t Section::memory_usage() const {
+	return sizeof(*this) + palette.capacity()*sizeof(uint32_t) + bits.capacity()*sizeof(uint64_t);
+}
+/* Section codec
+ * A section is a kind byte and what follows it. Multi-byte values are
+ * big-endian, and blocks are id<<4 | meta.
+ *   0  air, nothing follows
+ *   1  a single block: u16 block
+ *   2  packed: u8 palette size - 1, u16 palette[], then the palette index
+ *      of every block in section order (y fastest), each in as few bits
+ *      as the palette needs, most significant bit first
+ *   3  runs: the palette as in 2, a u16 run count, then for each run its
+ *      palette index and length - 1 in 4 bits, packed like 2. A run goes
+ *      up y and ends at the top of its column.
+ *   4  raw: 4096 block ids and 2048 bytes of metadata nibbles
+ * The encoder takes the smaller of packed and runs, and raw for sections
+ * of more than 256 distinct blocks. Sections are sent to clients and
+ * stored in world files this way, and raw is laid out like a mapped
+ * section so that world files can map it.
+ */
+enum {
+	SECTION_AIR,
+	SECTION_UNIFORM,
+	SECTION_PACKED,
+	SECTION_RUNS,
+	SECTION_RAW,
+};
+namespace {
+	struct BitWriter {
+		std::vector<uint8_t> &out;
+		uint32_t acc = 0;
+		int n = 0;
+		BitWriter(std::vector<uint8_t> &out) :out(out) {}
+		void put(uint32_t x, int bits) {
+			acc = acc << bits | x;
+			n += bits;
+			while (n >= 8) {
+				n -= 8;
+				out.push_back(acc >> n);
+			}
+		}
+		void flush() {
+			if (n)
+				out.push_back(acc << (8 - n));
+			n = 0;
+		}
+	};
+	struct BitReader {
+		const uint8_t *p, *end;
+		uint32_t acc = 0;
+		int n = 0;
+		// cleared when reading past the end
+		bool ok = true;
+		BitReader(const uint8_t *p, const uint8_t *end) :p(p), end(end) {}
+		uint32_t get(int bits) {
+			while (n < bits) {
+				if (p == end) {
+					ok = false;
+					return 0;
+				}
+				acc = acc << 8 | *p++;
+				n += 8;
+			}
+			n -= bits;
+			return acc >> n & ((1u << bits) - 1);
+		}
+	};
+}
+void Section::encode(std::vector<uint8_t> &out) const {
+	uint8_t index[4096];
+	int16_t lookup[4096];
+	uint16_t pal[256];
+	int n = 0;
+	uint16_t v;
+	if (!is_uniform(v)) {
+		memset(lookup, -1, sizeof(lookup));
+		for (int i = 0; i < 4096; i++) {
+			uint16_t b = get(i);
+			if (lookup[b] == -1) {
+				if (n == 256) {
+					out.push_back(SECTION_RAW);
+					out.resize(out.size() + 6144);
+					write_raw(&out[out.size() - 6144]);
+					return;
+				}
+				lookup[b] = n;
+				pal[n++] = b;
+			}
+			index[i] = lookup[b];
+		}
+		v = pal[0];
+	}
+	if (n <= 1) {
+		if (v) {
+			out.push_back(SECTION_UNIFORM);
+			out.push_back(v >> 8);
+			out.push_back(v);
+		} else {
+			out.push_back(SECTION_AIR);
+		}
+		return;
+	}
+	int width = 1;
+	while (1 << width < n)
+		width++;
+	int runs = 0;
+	for (int i = 0; i < 4096; i++)
+		if (!(i & 15) || index[i] != index[i-1])
+			runs++;
+	bool use_runs = 2 + (runs*(width+4) + 7)/8 < 4096*width/8;
+	out.push_back(use_runs ? SECTION_RUNS : SECTION_PACKED);
+	out.push_back(n - 1);
+	for (int j = 0; j < n; j++) {
+		out.push_back(pal[j] >> 8);
+		out.push_back(pal[j]);
+	}
+	BitWriter w(out);
+	if (use_runs) {
+		out.push_back(runs >> 8);
+		out.push_back(runs);
+		for (int i = 0; i < 4096; ) {
+			int start = i++;
+			while (i & 15 && index[i] == index[start])
+				i++;
+			w.put(index[start], width);
+			w.put(i - start - 1, 4);
+		}
+	} else {
+		for (int i = 0; i < 4096; i++)
+			w.put(index[i], width);
+	}
+	w.flush();
+}
+size_t Section::decode(const uint8_t *in, size_t len, bool in_place) {
+	if (!len)
+		return 0;
+	switch (in[0]) {
+	case SECTION_AIR:
+		fill(0);
+		return 1;
+	case SECTION_UNIFORM: {
+		if (len < 3 || (in[1] << 8 | in[2]) >= 4096)
+			return 0;
+		fill(in[1] << 8 | in[2]);
+		return 3;
+	}
+	case SECTION_RAW:
+		if (len < 1 + 6144)
+			return 0;
+		if (in_place)
+			map(in + 1);
+		else
+			load_raw(in + 1);
+		return 1 + 6144;
+	case SECTION_PACKED:
+	case SECTION_RUNS:
+		break;
+	default:
+		return 0;
+	}
+	if (len < 2)
+		return 0;
+	size_t n = in[1] + 1;
+	size_t header = 2 + 2*n + (in[0] == SECTION_RUNS ? 2 : 0);
+	if (n < 2 || len < header)
+		return 0;
+	std::vector<uint32_t> pal(n);
+	uint64_t seen[4096/64] = {};
+	for (size_t j = 0; j < n; j++) {
+		uint16_t b = in[2 + 2*j] << 8 | in[3 + 2*j];
+		if (b >= 4096 || seen[b >> 6] >> (b & 63) & 1)
+			return 0;
+		seen[b >> 6] |= (uint64_t)1 << (b & 63);
+		pal[j] = b;
+	}
+	int width = 1;
+	while (1u << width < n)
+		width++;
+	int new_bpe = 1;
+	while (1u << new_bpe < n)
+		new_bpe *= 2;
+	std::vector<uint64_t> packed(4096*new_bpe/64);
+	BitReader r(in + header, in + len);
+	if (in[0] == SECTION_PACKED) {
+		for (int i = 0; i < 4096; i++) {
+			uint32_t k = r.get(width);
+			if (k >= n)
+				return 0;
+			packed[i*new_bpe >> 6] |= (uint64_t)k << (i*new_bpe & 63);
+			pal[k] += 1 << 16;
+		}
+	} else {
+		int runs = in[header-2] << 8 | in[header-1];
+		int i = 0;
+		for (int j = 0; j < runs; j++) {
+			uint32_t k = r.get(width);
+			int run = r.get(4) + 1;
+			if (k >= n || i == 4096 || (i & 15) + run > 16)
+				return 0;
+			pal[k] += run << 16;
+			for (; run; run--, i++)
+				packed[i*new_bpe >> 6] |= (uint64_t)k << (i*new_bpe & 63);
+		}
+		if (i != 4096)
+			return 0;
+	}
+	if (!r.ok)
+		return 0;
+	for (uint32_t p : pal) {
+		if (p >> 16 == 4096) {
+			fill(p & 0xFFFF);
+			return r.p - in;
+		}
+	}
+	palette = std::move(pal);
+	bits = std::move(packed);
+	mapped = nullptr;
+	bpe = new_bpe;
+	return r.p - in;
 }
 #ifndef RSGAME_NETCLIENT
 /* Scheduled update system
@@ -158,31 +717,457 @@ void Level::set_tile(int x, int y, int z, uint8_t id, uint8_t metadata) {
  * The block id is recorded in the update, and the update
  * is discarded if the block changes in the meantime.
  */
+uint32_t *FlatMap::find(uint64_t key) {
+	if (!count)
+		return nullptr;
+	key++;
+	size_t mask = keys.size() - 1;
+	for (size_t i = slot(key);; i = (i + 1) & mask) {
+		if (keys[i] == key)
+			return &values[i];
+		if (!keys[i])
+			return nullptr;
+	}
+}
+bool FlatMap::insert(uint64_t key, uint32_t value) {
+	key++;
+	if ((count + 1)*2 > keys.size()) {
+		std::vector<uint64_t> old_keys = std::move(keys);
+		std::vector<uint32_t> old_values = std::move(values);
+		bits = std::max(bits + 1, 10);
+		keys.assign((size_t)1 << bits, 0);
+		values.resize(keys.size());
+		size_t mask = keys.size() - 1;
+		for (size_t j = 0; j < old_keys.size(); j++) {
+			if (!old_keys[j])
+				continue;
+			size_t i = slot(old_keys[j]);
+			while (keys[i])
+				i = (i + 1) & mask;
+			keys[i] = old_keys[j];
+			values[i] = old_values[j];
+		}
+	}
+	size_t mask = keys.size() - 1;
+	for (size_t i = slot(key);; i = (i + 1) & mask) {
+		if (keys[i] == key)
+			return false;
+		if (!keys[i]) {
+			keys[i] = key;
+			values[i] = value;
+			count++;
+			return true;
+		}
+	}
+}
+void FlatMap::erase(uint64_t key) {
+	if (!count)
+		return;
+	key++;
+	size_t mask = keys.size() - 1;
+	size_t i = slot(key);
+	while (keys[i] != key) {
+		if (!keys[i])
+			return;
+		i = (i + 1) & mask;
+	}
+	// shift the rest of the probe sequence back into the hole
+	for (size_t j = (i + 1) & mask; keys[j]; j = (j + 1) & mask) {
+		size_t h = slot(keys[j]);
+		if (((j - h) & mask) >= ((j - i) & mask)) {
+			keys[i] = keys[j];
+			values[i] = values[j];
+			i = j;
+		}
+	}
+	keys[i] = 0;
+	count--;
+}
+void FlatMap::clear() {
+	if (count)
+		std::fill(keys.begin(), keys.end(), 0);
+	count = 0;
+}
+bool UpdateWheel::insert(uint32_t index, uint8_t id, long target_tick) {
+	if (!pending.insert((uint64_t)index << 8 | id))
+		return false;
+	// only restored updates can be overdue, they come in order
+	if (target_tick < pos)
+		target_tick = pos;
+	ScheduledUpdate u = {index, id, target_tick};
+	long block = target_tick >> 6;
+	if (block <= (pos >> 6) + 1)
+		ticks[target_tick & 127].push_back(u);
+	else if (block <= (pos >> 6) + 64)
+		blocks[block & 63].push_back(u);
+	else
+		overflow.push_back(u);
+	return true;
+}
+void UpdateWheel::advance() {
+	ticks[pos & 127].clear();
+	head = 0;
+	pos++;
+	if (pos & 63)
+		return;
+	long block = pos >> 6;
+	auto &b = blocks[(block + 1) & 63];
+	for (auto &u : b)
+		ticks[u.target_tick & 127].push_back(u);
+	b.clear();
+	if (overflow.empty())
+		return;
+	auto &nb = blocks[(block + 64) & 63];
+	size_t n = 0;
+	for (auto &u : overflow) {
+		if (u.target_tick >> 6 == block + 64)
+			nb.push_back(u);
+		else
+			overflow[n++] = u;
+	}
+	overflow.resize(n);
+}
+bool UpdateWheel::pop(long tick, ScheduledUpdate &out) {
+	if (!pending.size()) {
+		// nothing to walk through, skip ahead
+		ticks[pos & 127].clear();
+		head = 0;
+		if (pos <= tick)
+			pos = tick + 1;
+		return false;
+	}
+	while (pos <= tick) {
+		auto &b = ticks[pos & 127];
+		if (head < b.size()) {
+			out = b[head++];
+			pending.erase((uint64_t)out.index << 8 | out.id);
+			return true;
+		}
+		advance();
+	}
+	return false;
+}
+void UpdateWheel::clear(long tick) {
+	for (auto &b : ticks)
+		b.clear();
+	for (auto &b : blocks)
+		b.clear();
+	overflow.clear();
+	pending.clear();
+	pos = tick;
+	head = 0;
+}
+std::vector<ScheduledUpdate> UpdateWheel::list() const {
+	std::vector<ScheduledUpdate> out;
+	out.reserve(pending.size());
+	auto &cur = ticks[pos & 127];
+	out.insert(out.end(), cur.begin() + head, cur.end());
+	for (long t = pos + 1; t >> 6 <= (pos >> 6) + 1; t++)
+		out.insert(out.end(), ticks[t & 127].begin(), ticks[t & 127].end());
+	auto by_tick = [](const ScheduledUpdate &a, const ScheduledUpdate &b) {
+		return a.target_tick < b.target_tick;
+	};
+	for (long block = (pos >> 6) + 2; block <= (pos >> 6) + 64; block++) {
+		size_t n = out.size();
+		out.insert(out.end(), blocks[block & 63].begin(), blocks[block & 63].end());
+		std::stable_sort(out.begin() + n, out.end(), by_tick);
+	}
+	size_t n = out.size();
+	out.insert(out.end(), overflow.begin(), overflow.end());
+	std::stable_sort(out.begin() + n, out.end(), by_tick);
+	return out;
+}
+void Level::run_scheduled_update(const ScheduledUpdate &u) {
+	ivec3 pos = index_to_pos(u.index);
+	if (u.id == get_tile_id(pos.x, pos.y, pos.z))
+		on_block_scheduled_update(pos.x, pos.y, pos.z, u.id);
+}
 void Level::on_tick() {
-	int updates_processed = 0;
-	while (!scheduled_updates.empty() && updates_processed < 1000) {
-		auto it = scheduled_updates.begin();
-		if (it->target_tick > tick)
-			break;
-		auto u = *it;
-		scheduled_tiles.erase(*it);
-		scheduled_updates.erase(it);
-		if (u.id == get_tile_id(u.x, u.y, u.z))
-			on_block_scheduled_update(u.x, u.y, u.z, u.id);
-		updates_processed++;
+	if (pool) {
+		run_batch();
+	} else {
+		int updates_processed = 0;
+		ScheduledUpdate u;
+		while (updates_processed < 1000 && scheduled_updates.pop(tick, u)) {
+			run_scheduled_update(u);
+			updates_processed++;
+		}
+#ifdef RSGAME_STATS
+		updates_run += updates_processed;
+#endif
 	}
 	tick++;
 }
 void Level::schedule_update(int x, int y, int z, long when) {
+	uint32_t index = pos_to_index(x, y, z);
+	if (index == (uint32_t)-1)
+		return;
 	uint8_t id = get_tile_id(x, y, z);
+	if (Sim *w = worker_sim) {
+		w->effects.push_back({SimEffect::SCHEDULE, w->number, 0, id, w->batch_pos, index, when});
+		return;
+	}
+	schedule(index, id, when, main_sim.batch_pos);
+}
+void Level::schedule(uint32_t index, uint8_t id, long when, uint32_t batch_pos) {
+	// the rest of a batch would still be pending if it ran in order
+	uint32_t *pos = batch_keys.find((uint64_t)index << 8 | id);
+	if (pos && *pos > batch_pos)
+		return;
+	scheduled_updates.insert(index, id, when);
+}
+void Level::set_dirty(int x, int y, int z) {
+	if (!rl)
+		return;
+	if (Sim *w = worker_sim)
+		w->effects.push_back({SimEffect::DIRTY, w->number, 0, 0, w->batch_pos, pos_to_index(x, y, z), 0});
+	else
+		rl->set_dirty(x, y, z);
+}
+/* Parallel ticks
+ * With more than one sim thread, a tick's scheduled updates are taken
+ * out of the wheel up front and split into islands, where updates in
+ * touching sections go in the same island. Each island claims its
+ * sections and the ones around them, except for those next to another
+ * island too, which nobody gets to use. Islands run on the workers,
+ * which can write their own sections and read any section nobody
+ * claimed. Changes to the journal, the renderer and the
+ * wheel are logged instead of made, and replaying the logs in the order
+ * of the updates that caused them gives exactly what running the batch
+ * in order would have. If an island strays into another one's claim,
+ * its writes are undone and the batch runs serially.
+ */
+void Level::set_sim_threads(int n) {
+	n = std::max(1, std::min(n, 64));
+	pool.reset();
+	if (n == 1)
+		return;
+	pool.reset(new SimPool);
+	for (int i = 0; i < n; i++) {
+		pool->sims.emplace_back(new Sim);
+		pool->sims.back()->number = i + 1;
+	}
+	// the calling thread runs the first one
+	for (int i = 1; i < n; i++)
+		pool->threads.emplace_back(&Level::sim_thread, this, pool.get(), pool->sims[i].get());
+}
+void Level::sim_thread(SimPool *p, Sim *s) {
+	// threads start before the first parallel tick
+	unsigned generation = 0;
+	std::unique_lock<std::mutex> lock(p->mutex);
+	for (;;) {
+		p->start_cv.wait(lock, [&] { return p->quit || p->generation != generation; });
+		if (p->quit)
+			return;
+		generation = p->generation;
+		lock.unlock();
+		run_worker(*s);
+		lock.lock();
+		if (++p->done == p->threads.size())
+			p->done_cv.notify_one();
+	}
+}
+void Level::run_worker(Sim &s) {
+	worker_sim = &s;
+	size_t i;
+	while (!pool->conflict && (i = pool->next_island++) < pool->islands.size()) {
+		s.island = i + 1;
+		for (uint32_t p : pool->islands[i]) {
+			s.batch_pos = p;
+			run_scheduled_update(batch[p]);
+		}
+	}
+	s.island = 0;
+	worker_sim = nullptr;
+}
+void Level::run_batch() {
 	ScheduledUpdate u;
-	u.x = x, u.y = y, u.z = z, u.id = id;
-	if (scheduled_tiles.find(u) == scheduled_tiles.end()) {
-		u.target_tick = when;
-		u.insertion_order = scheduled_update_counter++;
-		scheduled_tiles.insert(u);
-		scheduled_updates.insert(u);
+	batch.clear();
+	while (batch.size() < 1000 && scheduled_updates.pop(tick, u)) {
+		batch_keys.insert((uint64_t)u.index << 8 | u.id, batch.size());
+		batch.push_back(u);
+	}
+#ifdef RSGAME_STATS
+	updates_run += batch.size();
+#endif
+	bool done = false;
+	if (pool->serial_ticks)
+		pool->serial_ticks--;
+	else
+		done = run_islands();
+	for (size_t i = 0; !done && i < batch.size(); i++) {
+		main_sim.batch_pos = i;
+		run_scheduled_update(batch[i]);
+	}
+	main_sim.batch_pos = 0;
+	batch_keys.clear();
+}
+bool Level::run_islands() {
+	SimPool &p = *pool;
+	if (batch.size() < 2)
+		return false;
+	// sections with updates in them, grouped when they're close
+	auto section_of = [this](ivec3 s) {
+		return ((uint32_t)s.x*zsections + s.z)*8 + s.y;
+	};
+	auto root = [&p](uint32_t g) {
+		while (p.group_parent[g] != g)
+			g = p.group_parent[g] = p.group_parent[p.group_parent[g]];
+		return g;
+	};
+	p.section_groups.clear();
+	p.group_parent.clear();
+	p.group_sections.clear();
+	p.batch_groups.clear();
+	for (auto &u : batch) {
+		ivec3 pos = index_to_pos(u.index);
+		ivec3 s(pos.x >> 4, pos.y >> 4, pos.z >> 4);
+		if (uint32_t *g = p.section_groups.find(section_of(s))) {
+			p.batch_groups.push_back(*g);
+			continue;
+		}
+		uint32_t g = p.group_parent.size();
+		p.group_parent.push_back(g);
+		p.group_sections.push_back(s);
+		p.batch_groups.push_back(g);
+		p.section_groups.insert(section_of(s), g);
+		for (int dx = -1; dx <= 1; dx++)
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dz = -1; dz <= 1; dz++) {
+					ivec3 n = s + ivec3(dx, dy, dz);
+					if (n.x < 0 || n.x >= xsections || n.y < 0 || n.y >= 8 || n.z < 0 || n.z >= zsections)
+						continue;
+					if (uint32_t *o = p.section_groups.find(section_of(n))) {
+						uint32_t a = root(*o), b = root(g);
+						if (a != b)
+							p.group_parent[a] = b;
+					}
+				}
+	}
+	// islands are numbered by their first update
+	p.group_islands.assign(p.group_parent.size(), (uint32_t)-1);
+	p.islands.clear();
+	for (uint32_t i = 0; i < batch.size(); i++) {
+		uint32_t &island = p.group_islands[root(p.batch_groups[i])];
+		if (island == (uint32_t)-1) {
+			island = p.islands.size();
+			p.islands.emplace_back();
+		}
+		p.islands[island].push_back(i);
+	}
+	if (p.islands.size() < 2)
+		return false;
+	if (section_owner.size() != sections.size())
+		section_owner.assign(sections.size(), 0);
+	for (uint32_t g = 0; g < p.group_sections.size(); g++) {
+		uint32_t island = p.group_islands[root(g)] + 1;
+		for (int dx = -1; dx <= 1; dx++)
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dz = -1; dz <= 1; dz++) {
+					ivec3 n = p.group_sections[g] + ivec3(dx, dy, dz);
+					if (n.x < 0 || n.x >= xsections || n.y < 0 || n.y >= 8 || n.z < 0 || n.z >= zsections)
+						continue;
+					uint32_t &owner = section_owner[section_of(n)];
+					if (!owner) {
+						owner = island;
+						p.claimed.push_back(section_of(n));
+					} else if (owner != island) {
+						owner = CONTESTED;
+					}
+				}
+	}
+	p.next_island = 0;
+	p.conflict = false;
+	{
+		std::lock_guard<std::mutex> lock(p.mutex);
+		p.generation++;
+		p.done = 0;
+	}
+	p.start_cv.notify_all();
+	run_worker(*p.sims[0]);
+	{
+		std::unique_lock<std::mutex> lock(p.mutex);
+		p.done_cv.wait(lock, [&p] { return p.done == p.threads.size(); });
+	}
+	for (uint32_t s : p.claimed)
+		section_owner[s] = 0;
+	p.claimed.clear();
+#ifdef RSGAME_STATS
+	for (auto &w : p.sims) {
+		tile_reads += w->tile_reads;
+		block_updates += w->block_updates;
+		block_updates_skipped += w->block_updates_skipped;
+		w->tile_reads = w->block_updates = w->block_updates_skipped = 0;
+	}
+#endif
+	if (p.conflict) {
+		undo_effects();
+		// whatever strayed is likely to do it again next time
+		p.serial_ticks = 20;
+		return false;
+	}
+	merge_effects();
+	return true;
+}
+void Level::merge_effects() {
+	std::vector<SimEffect> &effects = pool->effects;
+	effects.clear();
+	for (auto &w : pool->sims) {
+		effects.insert(effects.end(), w->effects.begin(), w->effects.end());
+		w->effects.clear();
 	}
+	// an update's effects all come from one worker, already in order
+	std::stable_sort(effects.begin(), effects.end(), [](const SimEffect &a, const SimEffect &b) {
+		return a.batch_pos < b.batch_pos;
+	});
+	for (SimEffect &e : effects) {
+		ivec3 pos = index_to_pos(e.index);
+		switch (e.type) {
+			case SimEffect::SET:
+				if (journal)
+					journal->log(e.index, e.value, &section_at(pos.x, pos.y, pos.z) - sections.data());
+				if (e.old_value >> 4 != e.value >> 4) {
+					bool power_only = same_wire_shape(e.old_value >> 4, e.value >> 4);
+					forget_wire_infos(main_sim, pos.x, pos.y, pos.z, power_only);
+					for (auto &w : pool->sims)
+						if (w->number != e.sim)
+							forget_wire_infos(*w, pos.x, pos.y, pos.z, power_only);
+				}
+				break;
+			case SimEffect::DIRTY:
+				set_dirty(pos.x, pos.y, pos.z);
+				break;
+			case SimEffect::SCHEDULE:
+				schedule(e.index, e.value, e.when, e.batch_pos);
+				break;
+		}
+	}
+}
+void Level::undo_effects() {
+	for (auto &w : pool->sims) {
+		for (size_t i = w->effects.size(); i-- > 0;) {
+			SimEffect &e = w->effects[i];
+			if (e.type != SimEffect::SET)
+				continue;
+			ivec3 pos = index_to_pos(e.index);
+			section_at(pos.x, pos.y, pos.z).set((pos.x&15) << 8 | (pos.z&15) << 4 | (pos.y&15), e.old_value);
+		}
+		w->effects.clear();
+		// anything the worker cached might have come from reads that
+		// were refused, main_sim never saw the writes
+		w->wire_infos.clear();
+		w->free_wire_infos.clear();
+		w->wire_info_ids.clear();
+	}
+}
+std::vector<ScheduledUpdate> Level::get_scheduled_updates() {
+	return scheduled_updates.list();
+}
+void Level::clear_scheduled_updates() {
+	scheduled_updates.clear(tick);
+}
+void Level::restore_scheduled_update(uint32_t index, uint8_t id, long target_tick) {
+	scheduled_updates.insert(index, id, target_tick);
 }
 bool Level::powers_weakly(int x, int y, int z, int f) {
 	uint8_t id = get_tile_id(x, y, z);
@@ -202,37 +1187,14 @@ bool Level::powers_weakly(int x, int y, int z, int f) {
 			return false;
 		return fdata != data;
 	} else {
-		if (in_wire_propagation)
+		if (sim().in_wire_propagation)
 			return false;
 		uint8_t data = get_tile_meta(x, y, z);
 		if (data == 0)
 			return false;
 		if (f == 1)
 			return true;
-		bool pinched = tiles::is_opaque[get_tile_id(x, y+1, z)];
-		bool mxo = tiles::is_opaque[get_tile_id(x-1, y, z)];
-		bool pxo = tiles::is_opaque[get_tile_id(x+1, y, z)];
-		bool mzo = tiles::is_opaque[get_tile_id(x, y, z-1)];
-		bool pzo = tiles::is_opaque[get_tile_id(x, y, z+1)];
-		bool mx = tiles::is_power_source[get_tile_id(x-1, y, z)]
-			|| (!mxo     && tiles::is_power_source[get_tile_id(x-1, y-1, z)])
-			|| (!pinched && tiles::is_power_source[get_tile_id(x-1, y+1, z)]);
-		bool px = tiles::is_power_source[get_tile_id(x+1, y, z)]
-			|| (!pxo     && tiles::is_power_source[get_tile_id(x+1, y-1, z)])
-			|| (!pinched && tiles::is_power_source[get_tile_id(x+1, y+1, z)]);
-		bool mz = tiles::is_power_source[get_tile_id(x, y, z-1)]
-			|| (!mzo     && tiles::is_power_source[get_tile_id(x, y-1, z-1)])
-			|| (!pinched && tiles::is_power_source[get_tile_id(x, y+1, z-1)]);
-		bool pz = tiles::is_power_source[get_tile_id(x, y, z+1)]
-			|| (!pzo     && tiles::is_power_source[get_tile_id(x, y-1, z+1)])
-			|| (!pinched && tiles::is_power_source[get_tile_id(x, y+1, z+1)]);
-		switch (f) {
-			case 2: return mz && !mx && !px;
-			case 3: return pz && !mx && !px;
-			case 4: return mx && !mz && !pz;
-			case 5: return px && !mz && !pz;
-		}
-		return false;
+		return wire_info(x, y, z).faces >> f & 1;
 	}
 }
 bool Level::powers_strongly(int x, int y, int z, int f) {
@@ -276,7 +1238,32 @@ bool Level::powered_weakly(int x, int y, int z) {
 		powers_weakly(x-1, y, z, 4) ||
 		powers_weakly(x+1, y, z, 5);
 }
+/* Neighbour updates
+ * Placing or removing a wire sends updates to the same blocks over and
+ * over, since update_neighbors and update_wire_neighbors are called on
+ * overlapping positions. Blocks that don't react to updates aren't
+ * bothered at all. An update only looks at the blocks around it,
+ * so if a block's last update made no changes and nothing has been set
+ * since, updating it again would just do the same nothing, and it's
+ * skipped. Anything it could have scheduled is still pending, and a
+ * second schedule would be ignored. Everything else runs in the order
+ * it always has. The outermost event counts as a write too, since
+ * scheduled updates may have run before it, so nothing carries over
+ * from one event to the next.
+ */
+struct Level::Event {
+	Sim &s;
+	Event(Level *level) :s(level->sim()) {
+		if (!s.depth++)
+			s.count_write();
+	}
+	~Event() {
+		if (!--s.depth && s.updates_seen.size() > 4096)
+			s.updates_seen.clear();
+	}
+};
 void Level::on_block_scheduled_update(int x, int y, int z, uint8_t id) {
+	Event e(this);
 	if (id == 75 || id == 76) {
 		uint8_t data = get_tile_meta(x, y, z);
 		bool is_powered;
@@ -329,6 +1316,7 @@ void Level::on_block_update(int x, int y, int z) {
 	}
 }
 void Level::on_block_add(int x, int y, int z, uint8_t id) {
+	Event e(this);
 	if (id == 76) {
 		update_neighbors(x, y-1, z);
 		update_neighbors(x, y+1, z);
@@ -350,10 +1338,10 @@ void Level::on_block_add(int x, int y, int z, uint8_t id) {
 		update_wire_neighbors(x, y + (tiles::is_opaque[get_tile_id(x, y, z+1)]), z+1);
 	}
 	update_neighbors(x, y, z);
-	if (rl)
-		rl->set_dirty(x, y, z);
+	set_dirty(x, y, z);
 }
 void Level::on_block_remove(int x, int y, int z, uint8_t id) {
+	Event e(this);
 	if (id == 76) {
 		update_neighbors(x, y-1, z);
 		update_neighbors(x, y+1, z);
@@ -375,16 +1363,63 @@ void Level::on_block_remove(int x, int y, int z, uint8_t id) {
 		update_wire_neighbors(x, y + (tiles::is_opaque[get_tile_id(x, y, z+1)]), z+1);
 	}
 	update_neighbors(x, y, z);
-	if (rl)
-		rl->set_dirty(x, y, z);
+	set_dirty(x, y, z);
+}
+void Level::on_blocks_edited(const std::vector<BlockEdit> &edits) {
+	// nothing else runs in between, so what one edit's updates found
+	// unchanged can be skipped for the next
+	Event e(this);
+	for (const BlockEdit &edit : edits) {
+		ivec3 pos = index_to_pos(edit.index);
+		if (edit.new_id != 0)
+			on_block_add(pos.x, pos.y, pos.z, edit.new_id);
+		else
+			on_block_remove(pos.x, pos.y, pos.z, edit.old_id);
+	}
+}
+bool Level::is_block(uint32_t index, uint8_t id, uint8_t metadata) {
+	// index_to_pos takes apart any index, in the level or not
+	ivec3 pos = index_to_pos(index);
+	if (pos_to_index(pos.x, pos.y, pos.z) == (uint32_t)-1)
+		return false;
+	return get_tile_id(pos.x, pos.y, pos.z) == id && get_tile_meta(pos.x, pos.y, pos.z) == metadata;
 }
 void Level::update_neighbors(int x, int y, int z) {
-	on_block_update(x-1, y, z);
-	on_block_update(x+1, y, z);
-	on_block_update(x, y-1, z);
-	on_block_update(x, y+1, z);
-	on_block_update(x, y, z-1);
-	on_block_update(x, y, z+1);
+	update_block(x-1, y, z);
+	update_block(x+1, y, z);
+	update_block(x, y-1, z);
+	update_block(x, y+1, z);
+	update_block(x, y, z-1);
+	update_block(x, y, z+1);
+}
+void Level::update_block(int x, int y, int z) {
+	Sim &s = sim();
+#ifdef RSGAME_STATS
+	uint64_t &updates = worker_sim ? s.block_updates : block_updates;
+	uint64_t &skipped = worker_sim ? s.block_updates_skipped : block_updates_skipped;
+	updates++;
+#endif
+	if (!reacts_to_updates(get_tile_id(x, y, z)))
+		return;
+	uint32_t index = pos_to_index(x, y, z);
+	uint32_t *seen = s.updates_seen.find(index);
+	if (seen && *seen == s.writes) {
+#ifdef RSGAME_STATS
+		skipped++;
+#endif
+		return;
+	}
+	uint32_t writes = s.writes;
+	{
+		Event e(this);
+		on_block_update(x, y, z);
+	}
+	if (s.writes != writes)
+		return;
+	if ((seen = s.updates_seen.find(index)))
+		*seen = writes;
+	else
+		s.updates_seen.insert(index, writes);
 }
 void Level::update_wire_neighbors(int x, int y, int z) {
 	if (get_tile_id(x, y, z) == 55) {
@@ -397,50 +1432,372 @@ void Level::update_wire_neighbors(int x, int y, int z) {
 		update_neighbors(x, y+1, z);
 	}
 }
-void Level::wire_propagation_start(int x, int y, int z) {
-	wire_propagation(x, y, z, x, y, z);
-	pending_wire_updates_set.clear();
-	std::vector<ivec3> updates = std::move(pending_wire_updates);
-	for (auto v : updates)
-		update_neighbors(v.x, v.y, v.z);
-}
-void Level::wire_propagation(int x, int y, int z, int sx, int sy, int sz) {
-	int old_strength = get_tile_meta(x, y, z);
-	int new_strength = 0;
-	in_wire_propagation = true;
-	bool powered = powered_strongly(x, y, z);
-	in_wire_propagation = false;
-	if (powered) {
-		new_strength = 15;
+/* Wire connectivity
+ * What a wire connects to and whether something other than wire powers
+ * it only depends on the blocks around it, so it is worked out once and
+ * kept until a block id changes within reach. Connections and the faces
+ * a wire points at depend on the 3x3x3 cube around it, and being powered
+ * can also come from a torch two blocks away through an opaque block.
+ * The blocks that get updated when the wire turns on or off are all
+ * within two blocks as well, so the ones that would ignore the update
+ * are noted here and skipped. Torches turning on and off don't change
+ * any of that, so they only make nearby wires recheck their power.
+ * The aim was a tenth of the block reads per tick on large clock and
+ * counter builds. Together with the neighbour update skipping above,
+ * rsgame-simbench's clocks read 11x less than the level this replaced,
+ * line 18x and grid 31x, or 12x, 20x and 40x with breadth_first_wires.
+ * tower, all torches and no wire, only reads 1.7x less, as torches
+ * still probe the world on every update, so that part of the target
+ * isn't met.
+ */
+// a position followed by its neighbours in update_neighbors order
+static const ivec3 update_offsets[7] = {
+	ivec3(0, 0, 0),
+	ivec3(-1, 0, 0), ivec3(1, 0, 0),
+	ivec3(0, -1, 0), ivec3(0, 1, 0),
+	ivec3(0, 0, -1), ivec3(0, 0, 1),
+};
+Level::WireInfo &Level::wire_info(int x, int y, int z) {
+	Sim &s = sim();
+	uint32_t index = pos_to_index(x, y, z);
+	if (uint32_t *slot = s.wire_info_ids.find(index))
+		return s.wire_infos[*slot];
+	WireInfo w;
+	w.nin = w.nout = w.nnext = 0;
+	bool below = tiles::is_opaque[get_tile_id(x, y-1, z)];
+	bool above = tiles::is_opaque[get_tile_id(x, y+1, z)];
+	bool side_power[4];
+	for (int d = 0; d < 4; d++) {
+		int dx = x, dz = z;
+		switch (d) {
+			case 0: dx--; break;
+			case 1: dx++; break;
+			case 2: dz--; break;
+			case 3: dz++; break;
+		}
+		uint8_t side = get_tile_id(dx, y, dz);
+		uint8_t side_down = get_tile_id(dx, y-1, dz);
+		uint8_t side_up = get_tile_id(dx, y+1, dz);
+		bool side_opaque = tiles::is_opaque[side];
+		if (side == 55) {
+			w.in[w.nin++] = pos_to_index(dx, y, dz);
+			w.out[w.nout++] = pos_to_index(dx, y, dz);
+			w.next[w.nnext++] = pos_to_index(dx, y, dz);
+		}
+		if ((side_opaque ? side_up : side_down) == 55)
+			w.next[w.nnext++] = pos_to_index(dx, side_opaque ? y+1 : y-1, dz);
+		if (side_opaque) {
+			if (!above && side_up == 55)
+				w.in[w.nin++] = pos_to_index(dx, y+1, dz);
+		} else if (side_down == 55) {
+			w.in[w.nin++] = pos_to_index(dx, y-1, dz);
+		}
+		if (below && !side_opaque && side_down == 55)
+			w.out[w.nout++] = pos_to_index(dx, y-1, dz);
+		if (!above && side_up == 55)
+			w.out[w.nout++] = pos_to_index(dx, y+1, dz);
+		side_power[d] = tiles::is_power_source[side]
+			|| (!side_opaque && tiles::is_power_source[side_down])
+			|| (!above && tiles::is_power_source[side_up]);
+	}
+	bool mx = side_power[0], px = side_power[1], mz = side_power[2], pz = side_power[3];
+	w.reactive = 0;
+	for (int k = 0; k < 7; k++)
+		for (int f = 0; f < 6; f++) {
+			ivec3 v = ivec3(x, y, z) + update_offsets[k] + update_offsets[f+1];
+			if (reacts_to_updates(get_tile_id(v.x, v.y, v.z)))
+				w.reactive |= (uint64_t)1 << (k*6 + f);
+		}
+	w.faces = (mz && !mx && !px) << 2 | (pz && !mx && !px) << 3 | (mx && !mz && !pz) << 4 | (px && !mz && !pz) << 5;
+	w.source = -1;
+	uint32_t slot;
+	if (s.free_wire_infos.empty()) {
+		slot = s.wire_infos.size();
+		s.wire_infos.push_back(w);
 	} else {
-		for (int d = 0; d < 4; d++) {
-			int dx = x, dz = z;
-			switch (d) {
-				case 0: dx--; break;
-				case 1: dx++; break;
-				case 2: dz--; break;
-				case 3: dz++; break;
-			}
-			if (dx != sx || y != sy || dz != sz)
-				new_strength = std::max(new_strength, get_tile_id(dx, y, dz) == 55 ? get_tile_meta(dx, y, dz) : 0);
-			if (tiles::is_opaque[get_tile_id(dx, y, dz)]) {
-				if (!tiles::is_opaque[get_tile_id(x, y+1, z)])
-					if (dx != sx || y+1 != sy || dz != sz)
-						new_strength = std::max(new_strength, get_tile_id(dx, y+1, dz) == 55 ? get_tile_meta(dx, y+1, dz) : 0);
+		slot = s.free_wire_infos.back();
+		s.free_wire_infos.pop_back();
+		s.wire_infos[slot] = w;
+	}
+	s.wire_info_ids.insert(index, slot);
+	return s.wire_infos[slot];
+}
+void Level::forget_wire_infos(Sim &s, int x, int y, int z, bool power_only) {
+	if (!s.wire_info_ids.size())
+		return;
+	auto forget = [this, &s, power_only](int x, int y, int z) {
+		uint32_t index = pos_to_index(x, y, z);
+		if (index == (uint32_t)-1)
+			return;
+		if (uint32_t *slot = s.wire_info_ids.find(index)) {
+			if (power_only) {
+				s.wire_infos[*slot].source = -1;
 			} else {
-				if (dx != sx || y-1 != sy || dz != sz)
-					new_strength = std::max(new_strength, get_tile_id(dx, y-1, dz) == 55 ? get_tile_meta(dx, y-1, dz) : 0);
+				s.free_wire_infos.push_back(*slot);
+				s.wire_info_ids.erase(index);
+			}
+		}
+	};
+	for (int dx = -1; dx <= 1; dx++)
+		for (int dy = -1; dy <= 1; dy++)
+			for (int dz = -1; dz <= 1; dz++)
+				forget(x+dx, y+dy, z+dz);
+	forget(x-2, y, z);
+	forget(x+2, y, z);
+	forget(x, y-2, z);
+	forget(x, y+2, z);
+	forget(x, y, z-2);
+	forget(x, y, z+2);
+}
+void Level::clear_wire_infos() {
+	main_sim.wire_infos.clear();
+	main_sim.free_wire_infos.clear();
+	main_sim.wire_info_ids.clear();
+	if (pool)
+		for (auto &w : pool->sims) {
+			w->wire_infos.clear();
+			w->free_wire_infos.clear();
+			w->wire_info_ids.clear();
+		}
+}
+/* Wire propagation
+ * A wire has strength 15 if it is powered by something other than
+ * another wire, and otherwise one less than the strongest wire it
+ * connects to. wire_propagation goes about it the way the recursive
+ * engine before it did, step for step, so circuits behave the way
+ * they always have: a wire works out its strength, leaving out the
+ * wire it was reached from, and if that changed, writes it and visits
+ * the wires after it that don't have one less. The wires it's in the
+ * middle of are kept on wire_frames rather than the stack, so long
+ * lines can't overflow it, and what each connects to comes from its
+ * WireInfo. Wires that turned on or off, even just for a moment, get
+ * their neighbours updated at the end, in the order they finished.
+ * With breadth_first_wires, strengths are fixed up the way light is
+ * instead: first a breadth first pass clears every wire that could
+ * have been powered through the one that changed, then power spreads
+ * back in from the wires that are left, strongest first. Strengths are
+ * only written once it's settled, so a drop along a long line doesn't
+ * revisit every wire, but only wires that ended up on or off are
+ * updated around, in another order. Wires settle the same, but torches
+ * packed close enough to feel it, such as dense torch clocks, can end
+ * up in a different phase than they would have.
+ */
+void Level::wire_visit(uint32_t index, uint32_t source) {
+	Sim &s = sim();
+	ivec3 pos = index_to_pos(index);
+	WireInfo &w = wire_info(pos.x, pos.y, pos.z);
+	if (w.source < 0) {
+		s.in_wire_propagation = true;
+		w.source = powered_strongly(pos.x, pos.y, pos.z);
+		s.in_wire_propagation = false;
+	}
+	int strength = 15;
+	if (!w.source) {
+		strength = 0;
+		for (int i = 0; i < w.nin; i++) {
+			if (w.in[i] == source)
+				continue;
+			ivec3 v = index_to_pos(w.in[i]);
+			strength = std::max(strength, (int)get_tile_meta(v.x, v.y, v.z));
+		}
+		strength = std::max(strength-1, 0);
+	}
+	int old_strength = get_tile_meta(pos.x, pos.y, pos.z);
+	if (strength == old_strength)
+		return;
+	// the first can be a wire that was just removed, with nothing to write
+	if (get_tile_id(pos.x, pos.y, pos.z) == 55) {
+		set_tile(pos.x, pos.y, pos.z, 55, strength);
+		set_dirty(pos.x, pos.y, pos.z);
+	}
+	s.wire_frames.push_back({index, 0, (uint8_t)old_strength, (uint8_t)strength});
+}
+void Level::wire_propagation(int x, int y, int z) {
+	Sim &s = sim();
+	uint32_t start = pos_to_index(x, y, z);
+	wire_visit(start, start);
+	while (!s.wire_frames.empty()) {
+		// reads that conflicted come back as air, which could keep
+		// this going, and the whole tick runs again anyway
+		if (worker_sim && pool->conflict) {
+			s.wire_frames.clear();
+			return;
+		}
+		WireFrame &f = s.wire_frames.back();
+		ivec3 pos = index_to_pos(f.index);
+		const WireInfo &w = wire_info(pos.x, pos.y, pos.z);
+		if (f.next < w.nnext) {
+			uint32_t index = w.next[f.next++];
+			ivec3 v = index_to_pos(index);
+			if (get_tile_meta(v.x, v.y, v.z) != std::max(f.strength-1, 0))
+				wire_visit(index, f.index);
+			continue;
+		}
+		if (f.old_strength == 0 || f.strength == 0)
+			add_wire_updates(pos.x, pos.y, pos.z, w.reactive);
+		s.wire_frames.pop_back();
+	}
+}
+uint32_t Level::wire_node(uint32_t index) {
+	Sim &s = sim();
+	if (uint32_t *id = s.wire_node_ids.find(index))
+		return *id;
+	ivec3 pos = index_to_pos(index);
+	uint8_t strength = get_tile_meta(pos.x, pos.y, pos.z);
+	s.wire_nodes.push_back({index, strength, strength});
+	s.wire_node_ids.insert(index, s.wire_nodes.size() - 1);
+	return s.wire_nodes.size() - 1;
+}
+int Level::wire_strength(uint32_t index) {
+	Sim &s = sim();
+	if (uint32_t *id = s.wire_node_ids.find(index))
+		return s.wire_nodes[*id].strength;
+	ivec3 pos = index_to_pos(index);
+	return get_tile_meta(pos.x, pos.y, pos.z);
+}
+int Level::wire_input_strength(int x, int y, int z) {
+	Sim &s = sim();
+	WireInfo &w = wire_info(x, y, z);
+	if (w.source < 0) {
+		s.in_wire_propagation = true;
+		w.source = powered_strongly(x, y, z);
+		s.in_wire_propagation = false;
+	}
+	if (w.source)
+		return 15;
+	int strength = 0;
+	for (int i = 0; i < w.nin; i++)
+		strength = std::max(strength, wire_strength(w.in[i]));
+	return std::max(strength-1, 0);
+}
+void Level::wire_seed(int x, int y, int z) {
+	Sim &s = sim();
+	if (get_tile_id(x, y, z) != 55)
+		return;
+	uint32_t index = pos_to_index(x, y, z);
+	int strength = wire_input_strength(x, y, z);
+	if (strength == wire_strength(index))
+		return;
+	uint32_t id = wire_node(index);
+	WireNode &n = s.wire_nodes[id];
+	if (strength < n.strength) {
+		s.wire_queue.push_back(id << 4 | n.strength);
+		n.strength = 0;
+	} else if (strength > n.strength) {
+		n.strength = strength;
+		s.wire_buckets[strength].push_back(id);
+	}
+}
+void Level::propagate_wires() {
+	Sim &s = sim();
+	// queue entries are node << 4 | strength before it was cleared
+	for (size_t i = 0; i < s.wire_queue.size(); i++) {
+		ivec3 pos = index_to_pos(s.wire_nodes[s.wire_queue[i] >> 4].index);
+		int old_strength = s.wire_queue[i] & 15;
+		const WireInfo &w = wire_info(pos.x, pos.y, pos.z);
+		for (int j = 0; j < w.nout; j++) {
+			uint32_t id = wire_node(w.out[j]);
+			int strength = s.wire_nodes[id].strength;
+			if (strength && strength < old_strength) {
+				s.wire_nodes[id].strength = 0;
+				s.wire_queue.push_back(id << 4 | strength);
+			}
+		}
+	}
+	// cleared wires pick up whatever power is left around them
+	for (uint32_t e : s.wire_queue) {
+		ivec3 pos = index_to_pos(s.wire_nodes[e >> 4].index);
+		int strength = wire_input_strength(pos.x, pos.y, pos.z);
+		WireNode &n = s.wire_nodes[e >> 4];
+		if (strength > n.strength) {
+			n.strength = strength;
+			s.wire_buckets[strength].push_back(e >> 4);
+		}
+	}
+	s.wire_queue.clear();
+	for (int strength = 15; strength > 0; strength--) {
+		auto &bucket = s.wire_buckets[strength];
+		for (size_t i = 0; i < bucket.size(); i++) {
+			if (s.wire_nodes[bucket[i]].strength != strength)
+				continue;
+			ivec3 pos = index_to_pos(s.wire_nodes[bucket[i]].index);
+			const WireInfo &w = wire_info(pos.x, pos.y, pos.z);
+			for (int j = 0; j < w.nout; j++) {
+				uint32_t id = wire_node(w.out[j]);
+				if (s.wire_nodes[id].strength < strength-1) {
+					s.wire_nodes[id].strength = strength-1;
+					s.wire_buckets[strength-1].push_back(id);
+				}
 			}
 		}
-		new_strength = std::max(new_strength-1, 0);
+		bucket.clear();
+	}
+	s.wire_buckets[0].clear();
+	// farthest first, roughly what the recursive propagation did, see
+	// above for where it differs
+	for (size_t i = s.wire_nodes.size(); i-- > 0;) {
+		WireNode &n = s.wire_nodes[i];
+		s.wire_node_ids.erase(n.index);
+		if (n.strength == n.old_strength)
+			continue;
+		ivec3 pos = index_to_pos(n.index);
+		set_tile(pos.x, pos.y, pos.z, 55, n.strength);
+		set_dirty(pos.x, pos.y, pos.z);
+		if (n.old_strength == 0 || n.strength == 0)
+			add_wire_updates(pos.x, pos.y, pos.z, wire_info(pos.x, pos.y, pos.z).reactive);
 	}
-	if (old_strength != new_strength) {
-		if (get_tile_id(x, y, z) == 55) {
-			set_tile(x, y, z, 55, new_strength);
-			if (rl)
-				rl->set_dirty(x, y, z);
+	s.wire_nodes.clear();
+}
+void Level::add_wire_updates(int x, int y, int z, uint64_t reactive) {
+	Sim &s = sim();
+	for (int k = 0; k < 7; k++) {
+		ivec3 v = ivec3(x, y, z) + update_offsets[k];
+		if (s.wire_updates_seen.insert((uint64_t)(v.x+1) << 40 | (uint64_t)(v.z+1) << 8 | (v.y+1)))
+			s.wire_updates.push_back({v.x, v.y, v.z, (uint8_t)(reactive >> k*6 & 63)});
+	}
+}
+// what a wire at x, y, z would have, for one that was just removed
+int Level::gone_wire_strength(int x, int y, int z) {
+	Sim &s = sim();
+	s.in_wire_propagation = true;
+	bool powered = powered_strongly(x, y, z);
+	s.in_wire_propagation = false;
+	if (powered)
+		return 15;
+	auto strength_at = [this](int x, int y, int z) {
+		return get_tile_id(x, y, z) == 55 ? wire_strength(pos_to_index(x, y, z)) : 0;
+	};
+	int strength = 0;
+	bool pinched = tiles::is_opaque[get_tile_id(x, y+1, z)];
+	for (int d = 0; d < 4; d++) {
+		int dx = x, dz = z;
+		switch (d) {
+			case 0: dx--; break;
+			case 1: dx++; break;
+			case 2: dz--; break;
+			case 3: dz++; break;
+		}
+		strength = std::max(strength, strength_at(dx, y, dz));
+		if (tiles::is_opaque[get_tile_id(dx, y, dz)]) {
+			if (!pinched)
+				strength = std::max(strength, strength_at(dx, y+1, dz));
+		} else {
+			strength = std::max(strength, strength_at(dx, y-1, dz));
 		}
-		int target = std::max(new_strength-1, 0);
+	}
+	return std::max(strength-1, 0);
+}
+void Level::breadth_first_wire_propagation(int x, int y, int z) {
+	bool gone_changed = false;
+	if (get_tile_id(x, y, z) == 55) {
+		wire_seed(x, y, z);
+	} else {
+		/* The wire is gone, recheck everything it connected to. Its
+		 * place still gets neighbour updates if a wire there would
+		 * turn on or off, like it always has. */
+		int old_strength = get_tile_meta(x, y, z);
+		int strength = gone_wire_strength(x, y, z);
+		gone_changed = strength != old_strength && (old_strength == 0 || strength == 0);
 		for (int d = 0; d < 4; d++) {
 			int dx = x, dz = z;
 			switch (d) {
@@ -449,31 +1806,37 @@ void Level::wire_propagation(int x, int y, int z, int sx, int sy, int sz) {
 				case 2: dz--; break;
 				case 3: dz++; break;
 			}
-			int dy = tiles::is_opaque[get_tile_id(dx, y, dz)] ? y+1 : y-1;
-			if (get_tile_id(dx, y, dz) == 55)
-				if (get_tile_meta(dx, y, dz) != target)
-					wire_propagation(dx, y, dz, x, y, z);
-			if (get_tile_id(dx, dy, dz) == 55)
-				if (get_tile_meta(dx, dy, dz) != target)
-					wire_propagation(dx, dy, dz, x, y, z);
-		}
-		if (old_strength == 0 || new_strength == 0) {
-			auto add_update = [this](int x, int y, int z) {
-				ivec3 v(x, y, z);
-				if (pending_wire_updates_set.find(v) == pending_wire_updates_set.end()) {
-					pending_wire_updates_set.insert(v);
-					pending_wire_updates.push_back(v);
-				}
-			};
-			add_update(x, y, z);
-			add_update(x-1, y, z);
-			add_update(x+1, y, z);
-			add_update(x, y-1, z);
-			add_update(x, y+1, z);
-			add_update(x, y, z-1);
-			add_update(x, y, z+1);
+			wire_seed(dx, y, dz);
+			wire_seed(dx, y-1, dz);
+			wire_seed(dx, y+1, dz);
 		}
 	}
+	if (!sim().wire_nodes.empty())
+		propagate_wires();
+	if (gone_changed)
+		add_wire_updates(x, y, z, ~(uint64_t)0);
+}
+void Level::wire_propagation_start(int x, int y, int z) {
+	Sim &s = sim();
+	size_t first = s.wire_updates.size();
+	if (breadth_first_wires)
+		breadth_first_wire_propagation(x, y, z);
+	else
+		wire_propagation(x, y, z);
+	size_t last = s.wire_updates.size();
+	for (size_t i = first; i < last; i++) {
+		WireUpdate &u = s.wire_updates[i];
+		s.wire_updates_seen.erase((uint64_t)(u.x+1) << 40 | (uint64_t)(u.z+1) << 8 | (u.y+1));
+	}
+	// this is update_neighbors, minus the blocks that would ignore it.
+	// updates can start more propagation, which adds past the end
+	for (size_t i = first; i < last; i++) {
+		WireUpdate u = s.wire_updates[i];
+		for (int f = 0; f < 6; f++)
+			if (u.reactive >> f & 1)
+				update_block(u.x + update_offsets[f+1].x, u.y + update_offsets[f+1].y, u.z + update_offsets[f+1].z);
+	}
+	s.wire_updates.resize(first);
 }
 #endif
 }
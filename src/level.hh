@@ -4,36 +4,105 @@
 #include "tile.hh"
 namespace rsgame {
 	struct RenderLevel;
+	struct Journal;
 	struct ScheduledUpdate {
-		int x, y, z;
+		uint32_t index;
 		uint8_t id;
 		long target_tick;
-		long insertion_order;
-		struct HashSpace {
-			constexpr size_t operator()(const ScheduledUpdate &u) const {
-				size_t hash = u.x;
-				hash ^= u.y + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-				hash ^= u.z + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-				hash ^= u.id + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-				return hash;
-			}
-		};
-		struct EqualSpace {
-			constexpr bool operator()(const ScheduledUpdate &lhs, const ScheduledUpdate &rhs) const {
-				return lhs.x == rhs.x && lhs.y == rhs.y && lhs.z == rhs.z && lhs.id == rhs.id;
-			}
-		};
-		struct LessTime {
-			constexpr bool operator()(const ScheduledUpdate &lhs, const ScheduledUpdate &rhs) const {
-				return
-					lhs.target_tick < rhs.target_tick || lhs.target_tick == rhs.target_tick && (
-					lhs.insertion_order < rhs.insertion_order || lhs.insertion_order == rhs.insertion_order);
-			}
-		};
+	};
+	/* Open addressing hash map from 64-bit keys to 32-bit values, with
+	 * linear probing and backward shift deletion, so it never needs
+	 * tombstones and stops allocating once it has grown big enough. */
+	struct FlatMap {
+		uint32_t *find(uint64_t key);
+		// returns false if the key is already present
+		bool insert(uint64_t key, uint32_t value = 0);
+		void erase(uint64_t key);
+		void clear();
+		size_t size() const { return count; }
+	private:
+		// keys are stored plus one, 0 is an empty slot
+		std::vector<uint64_t> keys;
+		std::vector<uint32_t> values;
+		size_t count = 0;
+		int bits = 0;
+		size_t slot(uint64_t key) const {
+			return key*0x9E3779B97F4A7C15ull >> (64 - bits);
+		}
+	};
+	/* Pending scheduled updates, kept in a hierarchical timing wheel.
+	 * There is a bucket for each of the next 128 ticks, one for each of
+	 * the following 63 blocks of 64 ticks, and anything further away is
+	 * kept in an overflow list. Buckets are
+	 * FIFO, and a coarser bucket is moved down in order as soon as the
+	 * finer level can hold its ticks, so updates for the same tick come
+	 * out in the order they were scheduled. An update is identified by
+	 * pos_to_index and block id, and is only kept once. */
+	struct UpdateWheel {
+		// returns false if the update is already pending
+		bool insert(uint32_t index, uint8_t id, long target_tick);
+		// takes the next update due at or before tick
+		bool pop(long tick, ScheduledUpdate &out);
+		void clear(long tick);
+		std::vector<ScheduledUpdate> list() const;
+		size_t size() const { return pending.size(); }
+	private:
+		std::vector<ScheduledUpdate> ticks[128], blocks[64], overflow;
+		// earliest tick that can still have updates, and how many
+		// updates of its bucket have been taken already
+		long pos = 0;
+		size_t head = 0;
+		void advance();
+		// index << 8 | id of every pending update
+		FlatMap pending;
+	};
+	/* A 16x16x16 cube of blocks, each block stored as id<<4 | meta.
+	 * Sections with a single distinct block (usually air) have no
+	 * per-block storage. Mixed sections keep a palette and bit-packed
+	 * indices into it, and sections with more than 256 distinct blocks
+	 * fall back to plain id and nibble arrays. */
+	struct Section {
+		uint16_t get(int i) const {
+			if (bpe)
+				return palette[bits[i*bpe >> 6] >> (i*bpe & 63) & ((1 << bpe) - 1)] & 0xFFFF;
+			const uint8_t *raw = bits.empty() ? mapped : (const uint8_t *)bits.data();
+			if (!raw)
+				return palette.empty() ? 0 : palette[0] & 0xFFFF;
+			return raw[i] << 4 | raw[4096 + (i >> 1)] >> (i << 2 & 4) & 15;
+		}
+		void set(int i, uint16_t v);
+		size_t memory_usage() const;
+		void fill(uint16_t v);
+		// raw is 4096 ids followed by 2048 bytes of metadata nibbles
+		void map(const uint8_t *raw);
+		void unmap();
+		bool is_uniform(uint16_t &v) const;
+		void write_raw(uint8_t *out) const;
+		/* The section codec, see level.cc. encode appends the section
+		 * to out, and decode replaces it with one read from in,
+		 * returning how many bytes that took, or 0 if they're bad.
+		 * With in_place, a raw section is mapped from in like map
+		 * does instead of copied, so in has to stay around. */
+		void encode(std::vector<uint8_t> &out) const;
+		size_t decode(const uint8_t *in, size_t len, bool in_place = false);
+	private:
+		// palette entries are value | refcount<<16
+		std::vector<uint32_t> palette;
+		std::vector<uint64_t> bits;
+		const uint8_t *mapped = nullptr;
+		uint8_t bpe = 0;
+		void load_raw(const uint8_t *raw);
+		void put(int i, int index);
+		void repack(int new_bpe);
+		void make_direct();
 	};
 	struct Level {
 		Level(int xs = 512, int zs = 512, int zb = 9);
+		~Level();
+		Level(const Level&) =delete;
+		Level &operator=(const Level&) =delete;
 		RenderLevel *rl = nullptr;
+		Journal *journal = nullptr;
 		uint32_t pos_to_index(int x, int y, int z);
 		ivec3 index_to_pos(uint32_t index);
 		uint8_t get_tile_id(int x, int y, int z);
@@ -41,15 +110,30 @@ namespace rsgame {
 		void set_tile(int x, int y, int z, uint8_t id, uint8_t metadata);
 		int xsize, zsize;
 		int zbits;
-		long tick;
+		long tick = 0;
+#ifdef RSGAME_STATS
+		// get_tile_id calls and scheduled updates taken off the wheel
+		uint64_t tile_reads = 0, updates_run = 0;
+		// neighbour updates sent, and the ones skipped as duplicates
+		uint64_t block_updates = 0, block_updates_skipped = 0;
+#endif
 		void on_tick();
+		/* Scheduled updates in separate parts of the world can run
+		 * on several threads, see level.cc. 1 runs everything on
+		 * the calling thread. */
+		void set_sim_threads(int n);
+		/* Wires settle breadth first, see level.cc. Ends up with the
+		 * same strengths, but neighbour updates run in another order,
+		 * so circuits can behave differently than they used to. */
+		bool breadth_first_wires = false;
 	private:
-		std::unordered_set<ScheduledUpdate, ScheduledUpdate::HashSpace, ScheduledUpdate::EqualSpace> scheduled_tiles;
-		std::set<ScheduledUpdate, ScheduledUpdate::LessTime> scheduled_updates;
-		long scheduled_update_counter = 0;
+		UpdateWheel scheduled_updates;
 	public:
 		void schedule_update(int x, int y, int z, long when);
-		bool in_wire_propagation = false;
+		// pending updates in the order they will run, for saving
+		std::vector<ScheduledUpdate> get_scheduled_updates();
+		void clear_scheduled_updates();
+		void restore_scheduled_update(uint32_t index, uint8_t id, long target_tick);
 		bool powers_weakly(int x, int y, int z, int f);
 		bool powers_strongly(int x, int y, int z, int f);
 		bool powered_strongly_from(int x, int y, int z, int f);
@@ -60,16 +144,187 @@ namespace rsgame {
 		void on_block_add(int x, int y, int z, uint8_t id);
 		void on_block_remove(int x, int y, int z, uint8_t id);
 		void update_neighbors(int x, int y, int z);
+		/* Blocks that were all set with set_tile before any of their
+		 * neighbour updates ran, and what they replaced. Each gets
+		 * on_block_add or on_block_remove, in order, as one event. */
+		struct BlockEdit {
+			uint32_t index;
+			uint8_t old_id, new_id;
+		};
+		void on_blocks_edited(const std::vector<BlockEdit> &edits);
+		/* Whether index, which came from a client, is in the level and
+		 * the block there is id and metadata. */
+		bool is_block(uint32_t index, uint8_t id, uint8_t metadata);
 		void update_wire_neighbors(int x, int y, int z);
 		void wire_propagation_start(int x, int y, int z);
-		void wire_propagation(int x, int y, int z, int sx, int sy, int sz);
+	private:
+		friend struct Journal;
+		std::vector<Section> sections;
+		int xsections, zsections;
+		Section &section_at(int x, int y, int z) {
+			return sections[((x >> 4)*zsections + (z >> 4))*8 + (y >> 4)];
+		}
 	public:
-		std::vector<uint8_t> buf;
-		uint8_t *blocks;
-		uint8_t *data;
+		/* The flat format is every block id in x, z, y order followed by
+		 * the metadata nibbles in the same order. This is what gets sent
+		 * over the network. */
+		size_t flat_size();
+		void read_flat(size_t pos, uint8_t *out, size_t len);
+		void write_flat(size_t pos, const uint8_t *in, size_t len);
+		/* A copy of the blocks that can be read on another thread
+		 * while the level goes on changing. Making one is cheap, as
+		 * uniform sections have no storage and sections still read
+		 * from the world file share the mapping. */
+		struct Snapshot {
+			int xsize, zsize, zbits;
+			size_t flat_size() const;
+			void read_flat(size_t pos, uint8_t *out, size_t len) const;
+			void encode_sections(size_t first, size_t count, std::vector<uint8_t> &out) const;
+		private:
+			friend struct Level;
+			int zsections;
+			std::vector<Section> sections;
+			std::shared_ptr<const uint8_t> mapping;
+			uint16_t get(int x, int y, int z) const {
+				if (x >= xsize || z >= zsize)
+					return 0;
+				return sections[((x >> 4)*zsections + (z >> 4))*8 + (y >> 4)]
+					.get((x&15) << 8 | (z&15) << 4 | (y&15));
+			}
+		};
+		std::shared_ptr<const Snapshot> snapshot();
+		/* Sections in the codec's format, count of them starting at
+		 * first in the order of sections, which is x, z, y. false if
+		 * the data is bad or doesn't hold exactly that many. Different
+		 * sections can be decoded on different threads at once. */
+		bool decode_sections(size_t first, size_t count, const uint8_t *in, size_t len);
+		size_t memory_usage();
+		/* World files, see region.cc. Sections stored raw are read
+		 * directly out of the file mapping until they're modified.
+		 * Files in an older format load with outdated_file set, and
+		 * save always writes the current one. save keeps the journal
+		 * generation load found, see journal.cc. */
+		bool load(const char *path);
+		bool save(const char *path);
+		bool outdated_file = false;
+		uint32_t journal_generation = 0;
 	private:
-		std::unordered_set<ivec3> pending_wire_updates_set;
-		std::vector<ivec3> pending_wire_updates;
+		std::shared_ptr<const uint8_t> mapping;
+		/* Wire connectivity, see level.cc. in and out are the
+		 * pos_to_index of the wires this one takes its strength
+		 * from and of the ones that take it from this one, next
+		 * the ones wire_propagation visits after it, in order,
+		 * faces are the sides powers_weakly points at when the
+		 * wire is on, source is set when something other than wire
+		 * powers it (-1 until it's needed), and reactive has a bit
+		 * for each block that cares about the wire changing. */
+		struct WireInfo {
+			uint32_t in[8], out[12], next[8];
+			uint8_t nin, nout, nnext;
+			uint8_t faces;
+			int8_t source;
+			uint64_t reactive;
+		};
+		// a wire wire_propagation is in the middle of
+		struct WireFrame {
+			uint32_t index;
+			uint8_t next, old_strength, strength;
+		};
+		struct WireNode {
+			uint32_t index;
+			uint8_t old_strength, strength;
+		};
+		struct WireUpdate {
+			int x, y, z;
+			// which neighbours care about the update
+			uint8_t reactive;
+		};
+		/* What a worker did to the world during a parallel tick, in
+		 * the order it did it. batch_pos is the scheduled update
+		 * that caused it. value is the block for SET and the id for
+		 * SCHEDULE. */
+		struct SimEffect {
+			enum : uint8_t { SET, DIRTY, SCHEDULE } type;
+			uint8_t sim;
+			uint16_t old_value, value;
+			uint32_t batch_pos;
+			uint32_t index;
+			long when;
+		};
+		/* Everything the simulation changes other than the world
+		 * itself, one for each thread running it. */
+		struct Sim {
+			bool in_wire_propagation = false;
+			std::vector<WireInfo> wire_infos;
+			std::vector<uint32_t> free_wire_infos;
+			FlatMap wire_info_ids;
+			// wire propagation scratch space, kept around between runs
+			std::vector<WireFrame> wire_frames;
+			std::vector<WireNode> wire_nodes;
+			FlatMap wire_node_ids;
+			std::vector<uint32_t> wire_queue;
+			std::vector<uint32_t> wire_buckets[16];
+			FlatMap wire_updates_seen;
+			std::vector<WireUpdate> wire_updates;
+			// counts set_tile calls and outermost events, and for
+			// blocks updated, what it was at when the update
+			// finished. see update_block
+			uint32_t writes = 0;
+			int depth = 0;
+			FlatMap updates_seen;
+			void count_write() {
+				if (!++writes)
+					updates_seen.clear();
+			}
+			// 0 for main_sim, and the island being run, which is 0
+			// outside of parallel ticks
+			uint8_t number = 0;
+			uint32_t island = 0;
+			uint32_t batch_pos = 0;
+			std::vector<SimEffect> effects;
+#ifdef RSGAME_STATS
+			uint64_t tile_reads = 0;
+			uint64_t block_updates = 0, block_updates_skipped = 0;
+#endif
+		};
+		Sim main_sim;
+		static thread_local Sim *worker_sim;
+		Sim &sim() {
+			return worker_sim ? *worker_sim : main_sim;
+		}
+		WireInfo &wire_info(int x, int y, int z);
+		void forget_wire_infos(Sim &s, int x, int y, int z, bool power_only);
+		void clear_wire_infos();
+		void wire_visit(uint32_t index, uint32_t source);
+		void wire_propagation(int x, int y, int z);
+		uint32_t wire_node(uint32_t index);
+		int wire_strength(uint32_t index);
+		int wire_input_strength(int x, int y, int z);
+		int gone_wire_strength(int x, int y, int z);
+		void wire_seed(int x, int y, int z);
+		void propagate_wires();
+		void breadth_first_wire_propagation(int x, int y, int z);
+		void add_wire_updates(int x, int y, int z, uint64_t reactive);
+		void set_dirty(int x, int y, int z);
+		void update_block(int x, int y, int z);
+		struct Event;
+		// parallel ticks
+		struct SimPool;
+		std::unique_ptr<SimPool> pool;
+		std::vector<ScheduledUpdate> batch;
+		// index << 8 | id of each update in batch, to its position
+		FlatMap batch_keys;
+		// island + 1 of every section, 0 if it's not claimed
+		std::vector<uint32_t> section_owner;
+		void run_scheduled_update(const ScheduledUpdate &u);
+		void run_batch();
+		bool run_islands();
+		void run_worker(Sim &s);
+		void sim_thread(SimPool *p, Sim *s);
+		void schedule(uint32_t index, uint8_t id, long when, uint32_t batch_pos);
+		bool may_access(const Section &s, bool write);
+		void merge_effects();
+		void undo_effects();
 	};
 }
 #endif
@@ -10,6 +10,9 @@
 #ifdef RSGAME_NETCLIENT
 #include "net.hh"
 #include <zlib.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #endif
 namespace rsgame {
 bool verbose = true;
@@ -28,7 +31,9 @@ static Frustum viewfrustum;
 #if RSGAME_NETCLIENT
 int my_eid = -1;
 struct Entity {
-	float x, y, z, yaw, pitch;
+	// in 1/32 blocks, as sent
+	int x = 0, y = 0, z = 0;
+	float yaw = 0, pitch = 0;
 };
 std::unordered_map<int, Entity> entities;
 int connect_to_host(const char *connect_host, const char *connect_port)
@@ -74,6 +79,249 @@ int connect_to_host(const char *connect_host, const char *connect_port)
 	freeaddrinfo(res);
 	return sock;
 }
+// S_EntityEnter, S_EntityLeave, S_EntityUpdates and S_EntityDeltas,
+// false for anything else
+bool on_entity_packet(uint8_t *packet, int len)
+{
+	int plen = len - 2;
+	PacketReader pr(packet+2);
+	switch (pr.read8()) {
+		case S_EntityEnter: {
+			uint32_t eid = pr.read32();
+			entities.emplace(eid, Entity());
+			break;
+		}
+		case S_EntityLeave: {
+			uint32_t eid = pr.read32();
+			entities.erase(eid);
+			break;
+		}
+		case S_EntityUpdates:
+			for (int i = 0; i < (plen-1)/20; i++) {
+				uint32_t eid = pr.read32();
+				auto it = entities.find(eid);
+				if (it != entities.end()) {
+					it->second.x = (int32_t)pr.read32();
+					it->second.y = (int32_t)pr.read32();
+					it->second.z = (int32_t)pr.read32();
+					it->second.yaw = pr.read16()*2.f*glm::pi<float>()/65535;
+					it->second.pitch = pr.read16()*2.f*glm::pi<float>()/65535;
+				}
+			}
+			break;
+		case S_EntityDeltas: {
+			uint8_t *end = packet+len;
+			while (pr.buf < end) {
+				// unknown ones are still read past
+				Entity unknown;
+				auto it = entities.find(pr.read_varint());
+				Entity &ent = it != entities.end() ? it->second : unknown;
+				uint8_t fields = pr.read8();
+				if (fields & DELTA_X)
+					ent.x += pr.read_svarint();
+				if (fields & DELTA_Y)
+					ent.y += pr.read_svarint();
+				if (fields & DELTA_Z)
+					ent.z += pr.read_svarint();
+				if (fields & DELTA_YAW)
+					ent.yaw = pr.read8()*2.f*glm::pi<float>()/256;
+				if (fields & DELTA_PITCH)
+					ent.pitch = pr.read8()*2.f*glm::pi<float>()/256;
+			}
+			break;
+		}
+		default:
+			return false;
+	}
+	return true;
+}
+bool read_all(int sock, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	while (len) {
+		int r = net_read(sock, p, len);
+		if (r <= 0) {
+			if (r == 0)
+				fprintf(stderr, "Connection closed\n");
+			else
+				net_perror("read");
+			return false;
+		}
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+// inflates a world frame into out, which can't come to more than max
+bool inflate_frame(std::vector<uint8_t> &in, std::vector<uint8_t> &out, size_t max)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, -15) != Z_OK)
+		return false;
+	strm.next_in = in.data();
+	strm.avail_in = in.size();
+	// a byte to spare to tell when there's too much
+	out.resize(std::min(max + 1, in.size()*8 + 1024));
+	size_t have = 0;
+	int res = Z_OK;
+	while (res == Z_OK && strm.avail_in && have <= max) {
+		if (have == out.size())
+			out.resize(std::min(max + 1, out.size()*2));
+		strm.next_out = out.data() + have;
+		strm.avail_out = out.size() - have;
+		res = inflate(&strm, Z_SYNC_FLUSH);
+		have = out.size() - strm.avail_out;
+	}
+	bool ok = res == Z_OK && !strm.avail_in && have <= max;
+	if (!ok)
+		fprintf(stderr, "zlib failed: %s\n", strm.msg ? strm.msg : "frame too big");
+	inflateEnd(&strm);
+	out.resize(have);
+	return ok;
+}
+/* Frames of the world (see world_frames) are read on this thread and
+ * inflated by one thread per core, each taking the next frame that has
+ * come in, so inflating goes on while the rest is still arriving. Flat
+ * frames with the ids and the metadata of the same x columns are in the
+ * same sections, so writing one into the level holds the lock of its
+ * columns. Section frames each have sections of their own.
+ * With FEATURE_WORLD_PACKETS the frames are read out of S_WorldData
+ * packets, and entity packets that come in between are handled as
+ * they come.
+ */
+bool receive_world(int sock, FrameReader &reader, Level &level, uint32_t features)
+{
+	bool sections = features & FEATURE_WORLD_SECTIONS;
+	int frames = sections ? world_section_frames(level.xsize) : world_frames(level.xsize);
+	size_t frame_sections = world_frame_sections(level.zsize);
+	// the most a frame can inflate to
+	auto frame_size = [&](int i) {
+		if (sections)
+			return frame_sections * (1 + 6144);
+		size_t pos, len;
+		world_frame_range(i, level.xsize, level.zsize, pos, len);
+		return len;
+	};
+	std::vector<std::vector<uint8_t>> data(frames);
+	std::vector<std::mutex> column_locks(frames/2);
+	std::mutex mutex;
+	std::condition_variable cond;
+	int received = 0, next = 0;
+	bool failed = false;
+	auto inflate_frames = [&]() {
+		std::vector<uint8_t> flat;
+		for (;;) {
+			int i;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&] { return failed || next < received || next == frames; });
+				if (failed || next == frames)
+					return;
+				i = next++;
+				// the others are done too
+				if (next == frames)
+					cond.notify_all();
+			}
+			bool ok = inflate_frame(data[i], flat, frame_size(i));
+			std::vector<uint8_t>().swap(data[i]);
+			if (ok && sections) {
+				ok = level.decode_sections(i*frame_sections, frame_sections, flat.data(), flat.size());
+				if (!ok)
+					fprintf(stderr, "Bad sections in world frame %d\n", i);
+			} else if (ok) {
+				size_t pos, len;
+				world_frame_range(i, level.xsize, level.zsize, pos, len);
+				if ((ok = flat.size() == len)) {
+					std::lock_guard<std::mutex> lock(column_locks[i % (frames/2)]);
+					level.write_flat(pos, flat.data(), len);
+				} else {
+					fprintf(stderr, "World frame %d too short\n", i);
+				}
+			}
+			if (!ok) {
+				std::lock_guard<std::mutex> lock(mutex);
+				failed = true;
+				cond.notify_all();
+				return;
+			}
+		}
+	};
+	// what's left of the last S_WorldData
+	uint8_t *world_data = nullptr;
+	int world_left = 0;
+	auto read_world = [&](void *buf, size_t len) {
+		if (!(features & FEATURE_WORLD_PACKETS))
+			return read_all(sock, buf, len);
+		uint8_t *p = (uint8_t *)buf;
+		while (len) {
+			if (world_left) {
+				size_t n = std::min(len, (size_t)world_left);
+				memcpy(p, world_data, n);
+				world_data += n;
+				world_left -= n;
+				p += n;
+				len -= n;
+				continue;
+			}
+			int plen;
+			uint8_t *packet = reader.read(sock, plen);
+			if (!packet) {
+				if (reader.last == 0) {
+					fprintf(stderr, "Connection closed\n");
+					return false;
+				} else if (reader.last == -1) {
+					net_perror("read");
+					return false;
+				}
+				continue;
+			}
+			if (plen == 2)
+				continue;
+			if (packet[2] == S_WorldData) {
+				world_data = packet + 3;
+				world_left = plen - 3;
+			} else if (packet[2] == B_Disconnect) {
+				fprintf(stderr, "Disconnected: %.*s\n", plen-3, &packet[3]);
+				return false;
+			} else if (!on_entity_packet(packet, plen)) {
+				fprintf(stderr, "Protocol error\n");
+				return false;
+			}
+		}
+		return true;
+	};
+	std::vector<std::thread> threads;
+	int thread_count = std::min(frames, std::max(1, (int)std::thread::hardware_concurrency()));
+	for (int i = 0; i < thread_count; i++)
+		threads.emplace_back(inflate_frames);
+	for (int i = 0; i < frames; i++) {
+		uint8_t lenbuf[4];
+		bool ok = read_world(lenbuf, 4);
+		uint32_t size = PacketReader(lenbuf).read32();
+		if (ok && size > compressBound(frame_size(i)) + 64) {
+			fprintf(stderr, "World frame too big\n");
+			ok = false;
+		}
+		if (ok) {
+			data[i].resize(size);
+			ok = read_world(data[i].data(), size);
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!ok || failed) {
+			failed = true;
+			cond.notify_all();
+			break;
+		}
+		received++;
+		cond.notify_one();
+		if (i % 16 == 15)
+			fprintf(stderr, "world frames received: %d/%d\n", i+1, frames);
+	}
+	for (auto &t : threads)
+		t.join();
+	return !failed;
+}
 #endif
 int main(int argc, char** argv)
 {
@@ -198,17 +446,22 @@ int main(int argc, char** argv)
 #endif
 
 	fprintf(stderr, "Loading level...\n");
-	Level level;
 #ifdef RSGAME_NETCLIENT
+	uint32_t xsize, zsize, zbits, features;
 	{
-		uint8_t pbuf[2+21];
+		uint8_t pbuf[2+25];
 		PacketWriter(pbuf)
 			.write8(C_ClientIntroduction)
 			.write32(RSGAME_NETPROTO)
+			.write32(FEATURE_WORLD_SECTIONS | FEATURE_ENTITY_DELTAS | FEATURE_SECTION_UPDATES |
+				FEATURE_WORLD_PACKETS)
 			.send(sock);
-		net_read(sock, pbuf, 2+21);
+		if (!read_all(sock, pbuf, 2))
+			return 1;
 		PacketReader pr(pbuf);
 		uint16_t plen = pr.read16();
+		if (plen > 25 || !read_all(sock, pbuf+2, plen))
+			plen = 0;
 		if (!plen) {
 			fprintf(stderr, "Protocol error\n");
 			return 1;
@@ -226,50 +479,28 @@ int main(int argc, char** argv)
 			fprintf(stderr, "Incompatible protocol %X instead of %X\n", proto, RSGAME_NETPROTO);
 			return 1;
 		}
-		if (plen != 21) {
+		if (plen != 25) {
 			fprintf(stderr, "Bad packet size\n");
 			return 1;
 		}
 		my_eid = pr.read32();
-		uint32_t xsize = pr.read32();
-		uint32_t zsize = pr.read32();
-		uint32_t zbits = pr.read32();
-		level = Level(xsize, zsize, zbits);
-		{
-			z_stream strm;
-			uint8_t zbuf[1024];
-			memset(&strm, 0, sizeof(strm));
-			inflateInit(&strm);
-			strm.next_out = level.buf.data();
-			strm.avail_out = level.buf.size();
-			int res = Z_OK;
-			while (res == Z_OK) {
-				int r = net_read(sock, zbuf, 1024);
-				if (r <= 0) {
-					net_perror("read");
-					return 1;
-				}
-				strm.next_in = zbuf;
-				strm.avail_in = sizeof(zbuf);
-				fprintf(stderr, "bytes remaining: %d\n", strm.avail_out);
-				res = inflate(&strm, Z_NO_FLUSH);
-				if (res == Z_OK) {
-					if (strm.avail_in != 0) {
-						fprintf(stderr, "zlib doesn't work the way I want it to work\n");
-						return 1;
-					}
-				} else if (res != Z_STREAM_END) {
-					fprintf(stderr, "zlib failed: %s\n", strm.msg);
-					return 1;
-				}
-			}
-			if (strm.avail_out != 0) {
-				fprintf(stderr, "zlib stream too short\n");
-				return 1;
-			}
-			inflateEnd(&strm);
-		}
+		xsize = pr.read32();
+		zsize = pr.read32();
+		zbits = pr.read32();
+		features = pr.read32();
 	}
+	// Level can't be assigned, so it's only made once the size is known
+	Level level(xsize, zsize, zbits);
+	FrameReader reader;
+	if (!receive_world(sock, reader, level, features))
+		return 1;
+	// from here on packets are read as they come, see FrameReader
+	if (net_nonblock(sock) == -1) {
+		net_perror("net_nonblock");
+		return 1;
+	}
+#else
+	Level level;
 #endif
 
 	fprintf(stderr, "Allocating chunks...\n");
@@ -659,83 +890,80 @@ int main(int argc, char** argv)
 					}
 				}
 				{
-					static uint8_t pbuf[2+65536];
-					static int ppos = 0;
-					net_nonblock(sock);
-					for (;;) {
-						if (ppos < 2) {
-							int r = net_read(sock, pbuf+ppos, 2-ppos);
-							if (r == -1 || r == 0) {
-								if (r && net_again())
-									break;
-								if (r)
-									net_perror("net_read");
+					uint8_t *packet;
+					int len;
+					while ((packet = reader.read(sock, len))) {
+						int plen = len - 2;
+						if (!plen)
+							continue;
+						PacketReader pr(packet+2);
+						switch (pr.read8()) {
+							case B_Disconnect:
+								fprintf(stderr, "Disconnected\n");
 								return 1;
-							}
-							ppos += r;
-						} else {
-							int plen = pbuf[0]<<16 | pbuf[1];
-							if (!plen) {
-								ppos = 0;
-								continue;
-							}
-							int r = net_read(sock, pbuf+ppos, plen+2-ppos);
-							if (r == -1 || r == 0) {
-								if (r && net_again())
-									break;
-								if (r)
-									net_perror("net_read");
-								return 1;
-							}
-							ppos += r;
-							if (ppos == plen+2) {
-								PacketReader pr(pbuf+2);
-								switch (pr.read8()) {
-									case B_Disconnect:
-										fprintf(stderr, "Disconnected\n");
+							case S_BlockUpdates:
+								for (int i = 0; i < (plen-1)/6; i++) {
+									uint32_t index = pr.read32();
+									uint8_t id = pr.read8();
+									uint8_t data = pr.read8();
+									ivec3 bpos = level.index_to_pos(index);
+									level.set_tile(bpos.x, bpos.y, bpos.z, id, data);
+									rl->set_dirty(bpos.x, bpos.y, bpos.z);
+								}
+								break;
+							case S_SectionUpdates: {
+								uint8_t *end = packet+len;
+								int zsections = (level.zsize + 15) / 16;
+								while (pr.buf < end) {
+									uint32_t section = pr.read_varint(), count = pr.read_varint();
+									int bx = section / 8 / zsections * 16, bz = section / 8 % zsections * 16, by = section % 8 * 16;
+									if (bx >= level.xsize || bz >= level.zsize) {
+										fprintf(stderr, "Protocol error\n");
 										return 1;
-									case S_BlockUpdates:
-										for (int i = 0; i < (plen-1)/6; i++) {
-											uint32_t index = pr.read32();
-											uint8_t id = pr.read8();
-											uint8_t data = pr.read8();
-											ivec3 bpos = level.index_to_pos(index);
-											level.set_tile(bpos.x, bpos.y, bpos.z, id, data);
+									}
+									for (uint32_t i = 0; i < count; i++) {
+										uint16_t entry = pr.read16();
+										int o = entry >> 4, kind = entry & 15;
+										ivec3 bpos(bx + (o >> 8), by + (o & 15), bz + (o >> 4 & 15));
+										if (kind == SECTION_BLOCK) {
+											uint16_t v = pr.read16();
+											level.set_tile(bpos.x, bpos.y, bpos.z, v >> 4, v & 15);
 											rl->set_dirty(bpos.x, bpos.y, bpos.z);
+											continue;
 										}
-										break;
-									case S_EntityEnter: {
-										uint32_t eid = pr.read32();
-										entities.emplace(eid, Entity());
-										break;
-									}
-									case S_EntityLeave: {
-										uint32_t eid = pr.read32();
-										entities.erase(eid);
-										break;
-									}
-									case S_EntityUpdates:
-										for (int i = 0; i < (plen-1)/20; i++) {
-											uint32_t eid = pr.read32();
-											auto it = entities.find(eid);
-											if (it != entities.end()) {
-												it->second.x = (int32_t)pr.read32()/32.f;
-												it->second.y = (int32_t)pr.read32()/32.f;
-												it->second.z = (int32_t)pr.read32()/32.f;
-												it->second.yaw = pr.read16()*2.f*glm::pi<float>()/65535;
-												it->second.pitch = pr.read16()*2.f*glm::pi<float>()/65535;
-											}
+										ivec3 step(kind == SECTION_RUN_X, kind == SECTION_RUN_Y, kind == SECTION_RUN_Z);
+										int len = pr.read8();
+										uint8_t id = pr.read8(), data = 0;
+										ivec3 last = bpos + step*(len-1);
+										if (kind > SECTION_RUN_X || !len || last.x >> 4 != bpos.x >> 4 ||
+												last.y >> 4 != bpos.y >> 4 || last.z >> 4 != bpos.z >> 4) {
+											fprintf(stderr, "Protocol error\n");
+											return 1;
 										}
-										break;
-									default:
-										fprintf(stderr, "Protocol error\n");
-										return 1;
+										for (int k = 0; k < len; k++, bpos += step) {
+											if (!(k & 1))
+												data = pr.read8();
+											level.set_tile(bpos.x, bpos.y, bpos.z, id, k & 1 ? data & 15 : data >> 4);
+											rl->set_dirty(bpos.x, bpos.y, bpos.z);
+										}
+									}
 								}
-								ppos = 0;
+								break;
 							}
+							default:
+								if (!on_entity_packet(packet, len)) {
+									fprintf(stderr, "Protocol error\n");
+									return 1;
+								}
 						}
 					}
-					net_block(sock);
+					if (reader.last == 0) {
+						fprintf(stderr, "Connection closed\n");
+						return 1;
+					} else if (reader.last == -1 && !net_again()) {
+						net_perror("net_read");
+						return 1;
+					}
 				}
 #else
 				level.on_tick();
@@ -766,9 +994,9 @@ int main(int argc, char** argv)
 				if (p == (&player_pts)[1])
 					break;
 				if (ent.first != my_eid) {
-					*p++ = ent.second.x;
-					*p++ = ent.second.y;
-					*p++ = ent.second.z;
+					*p++ = ent.second.x/32.f;
+					*p++ = ent.second.y/32.f;
+					*p++ = ent.second.z/32.f;
 					*p++ = ent.second.yaw;
 				}
 			}
@@ -3,9 +3,23 @@
 #include "level.hh"
 #include "tile.hh"
 #include "net.hh"
+#include "journal.hh"
+#include "uring.hh"
+#include "spsc.hh"
 #include <stdio.h>
 #include <time.h>
+#include <signal.h>
 #include <zlib.h>
+#include <deque>
+#include <bitset>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <chrono>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#endif
 namespace rsgame {
 #ifndef WIN32
 timespec time0;
@@ -33,150 +47,903 @@ uint64_t time_ticks() {
 	return (uint64_t)((now.QuadPart - time0.QuadPart)*1000 / timef.QuadPart);
 }
 #endif
-int next_eid = 0;
+/* The server runs one simulation thread (main) and --io-threads network
+ * threads. Each network thread owns the connections it was given and
+ * everything about them: sockets, buffers, its own Poll. It decodes the
+ * packets it reads into ClientEvents for the simulation thread, and
+ * writes out the ServerMessages the simulation thread sends back. Each
+ * direction is a SpscQueue, so no locks are involved.
+ * The first network thread also owns the listening socket and hands new
+ * connections out to all of them in turn.
+ * The simulation thread keeps what it needs to know about players in its
+ * own table, keyed by entity id, so it never touches a Connection.
+ */
+// the C_ClientIntroduction features this server has
+const uint32_t server_features = FEATURE_WORLD_SECTIONS | FEATURE_ENTITY_DELTAS | FEATURE_SECTION_UPDATES |
+	FEATURE_WORLD_PACKETS;
+struct ClientEvent {
+	// CONGESTED and DRAINED: the connection's send queue went over
+	// --send-queue-limit, and back under half of it, see Player::congested
+	enum { JOIN, LEAVE, POSITION, BLOCK, CONGESTED, DRAINED } type;
+	int eid;
+	int x, y, z;
+	short yaw, pitch;
+	uint32_t index;
+	uint8_t old_id, old_data, new_id, new_data;
+	// JOIN: the protocol the client asked for, and which of the
+	// features it asked for it gets, -1 if it didn't send any
+	uint32_t proto, features;
+};
+/* Outgoing data is never copied per connection. It's built once into a
+ * SharedBuffer, which doesn't change after that, and every connection it
+ * goes to queues a reference to it.
+ */
+typedef std::shared_ptr<const std::vector<uint8_t>> SharedBuffer;
+/* A FIFO of buffers that keeps its memory when it runs empty. It's
+ * written out with one gather write over as many buffers as fit, and
+ * taking off what was sent is linear in the number of buffers finished,
+ * however big they are.
+ */
+struct OutQueue {
+	std::vector<SharedBuffer> bufs;
+	size_t head = 0;
+	// how much of the first buffer has been sent
+	size_t pos = 0;
+	// bytes ever queued, and taken off since
+	uint64_t pushed = 0, popped = 0;
+	bool empty() const {
+		return head == bufs.size();
+	}
+	SharedBuffer &front() {
+		return bufs[head];
+	}
+	void push(const SharedBuffer &buf) {
+		bufs.push_back(buf);
+		pushed += buf->size();
+	}
+	void pop() {
+		bufs[head++].reset();
+		pos = 0;
+		if (head == bufs.size()) {
+			bufs.clear();
+			head = 0;
+		} else if (head >= 64 && head*2 >= bufs.size()) {
+			bufs.erase(bufs.begin(), bufs.begin() + head);
+			head = 0;
+		}
+	}
+	// fills iov with what's to be sent, returns how many were used and
+	// sets len to how much that is
+	int gather(net_iovec *iov, int max, size_t &len) {
+		int n = 0;
+		len = 0;
+		for (size_t i = head; i < bufs.size() && n < max; i++) {
+			size_t skip = i == head ? pos : 0;
+			net_iovec_set(iov[n++], bufs[i]->data() + skip, bufs[i]->size() - skip);
+			len += bufs[i]->size() - skip;
+		}
+		return n;
+	}
+	// moves the first n buffers to out
+	void take(int n, std::vector<SharedBuffer> &out) {
+		while (n--) {
+			popped += front()->size() - pos;
+			out.push_back(std::move(front()));
+			pop();
+		}
+	}
+	void consume(size_t len) {
+		popped += len;
+		while (len) {
+			size_t left = front()->size() - pos;
+			if (len < left) {
+				pos += len;
+				return;
+			}
+			len -= left;
+			pop();
+		}
+	}
+	size_t bytes() const {
+		return pushed - popped;
+	}
+	// moves the first buffer, which hasn't been started on, to the end
+	// of to
+	void move_front(OutQueue &to) {
+		popped += front()->size();
+		to.push(front());
+		pop();
+	}
+	// drops all but what's already started on
+	void drop_unsent() {
+		size_t keep = head + (pos != 0);
+		for (size_t i = keep; i < bufs.size(); i++)
+			popped += bufs[i]->size();
+		bufs.resize(keep);
+		if (head == bufs.size()) {
+			bufs.clear();
+			head = 0;
+		}
+	}
+};
+/* A connection sends what it's given through one of these channels,
+ * so a player downloading the world still gets entity updates on time.
+ * See Connection::schedule.
+ */
+enum Channel {
+	// disconnects
+	CH_CONTROL,
+	// S_EntityEnter, S_EntityLeave, S_EntityUpdates and S_EntityDeltas
+	CH_ENTITY,
+	// S_BlockUpdates and S_SectionUpdates
+	CH_BLOCKS,
+	// the introduction and the world
+	CH_BULK,
+	CHANNELS
+};
+struct ServerMessage {
+	// LOGIN is sent once, after the world, and from then on the
+	// connection is a player, see Connection::queued
+	enum { SEND, LOGIN } type;
+	int eid;
+	SharedBuffer data;
+	Channel channel;
+};
+struct IoThread {
+	std::thread thread;
+	std::promise<bool> started;
+	// from the first network thread
+	SpscQueue<int> new_socks;
+	SpscQueue<ClientEvent> events;
+	SpscQueue<ServerMessage> messages;
+};
+std::vector<std::unique_ptr<IoThread>> io_threads;
+std::atomic<bool> io_quit{false};
+std::atomic<int> next_eid{0};
+std::atomic<size_t> open_conns{0};
+thread_local IoThread *io_self;
+struct Connection;
+// called when a connection's write buffer stops being empty
+void write_blocked(Connection *conn);
+thread_local std::vector<Connection*> dead_conns;
+/* Backpressure. Whatever a player hasn't taken yet waits in its
+ * connection's OutQueue, not counting the world it got when joining.
+ * Once that's more than send_queue_limit, the simulation is told to
+ * stop sending it entity moves and block updates, which it catches up
+ * on with the latest state once the queue is down to half the limit
+ * again. A player that stays over the limit for slow_client_timeout
+ * seconds is sent B_Disconnect after what it's already being sent, and
+ * dropped once that's out, or a few seconds later. Queues are checked
+ * at the end of a poll cycle, once they've been flushed.
+ */
+// see --send-queue-limit and --slow-client-timeout
+size_t send_queue_limit = 256*1024;
+int slow_client_timeout = 30;
+const uint64_t disconnect_linger_ms = 5000;
+// queues written to or flushed this poll cycle
+thread_local std::vector<Connection*> queue_checks;
+// congested connections, and evicted ones on their way out
+thread_local std::vector<Connection*> slow_conns;
+// since the last report_queues
+thread_local int evicted = 0;
+/* Scheduling. Buffers wait in their channel until schedule() moves them
+ * to outq, the order they go out in, and it only does while outq has
+ * less than commit_size in it, so what comes later can still go first.
+ * Control goes straight away, the other channels take turns by deficit
+ * round robin, each getting to send its quantum a round. Bulk is also
+ * held to bulk_per_tick every 50 ms, which is what keeps a download
+ * from filling the socket's buffer ahead of everything else.
+ * The world has to come before any block updates, and for clients
+ * without FEATURE_WORLD_PACKETS before anything but a disconnect.
+ */
+const size_t commit_size = 16*1024;
+const int notsent_lowat = 16*1024;
+const int channel_quantum[CHANNELS] = {0, 16*1024, 8*1024, 4*1024};
+// see --bulk-per-tick
+size_t bulk_per_tick = 256*1024;
+// connections waiting for their bulk allowance
+thread_local std::vector<Connection*> throttled_conns;
+/* Reading. Every poll cycle the connections with something to read take
+ * turns of read_quantum packets each, until they've had packets_per_poll
+ * or have nothing left, so one fast sender can't hold up the rest. What
+ * a connection has left waits in ready_conns for the next cycle, which
+ * then doesn't wait on the poller, as epoll only reports a socket again
+ * once more comes in. On top of that a connection is read at no more
+ * than packet_rate packets a second, with a second's worth of burst.
+ * Over that it isn't read at all for the time being, so its socket fills
+ * up and the client has to slow down. With io_uring what it sends still
+ * lands in its reader until that holds RingPoll::recv_limit, and only
+ * then does its socket fill up.
+ */
+const int read_quantum = 8;
+const int packets_per_poll = 64;
+// see --packet-rate
+int packet_rate = 1000;
+thread_local std::vector<Connection*> ready_conns;
+// ready_conns has a connection that can be read right away
+thread_local bool reads_left = false;
 struct Connection {
 	Connection(int sock) :sock(sock), eid(next_eid++) {}
 	int sock;
 	bool dead = false;
+	// sent a valid introduction, the simulation knows about it
+	bool joined = false;
 	bool logged_in = false;
-	int oldx = 0, oldy = 0, oldz = 0;
-	short oldyaw = 0, oldpitch = 0;
-	int x = 0, y = 0, z = 0;
-	short yaw = 0, pitch = 0;
 	int eid = 0;
-	std::vector<uint8_t> writebuf;
-	uint8_t readbuf[2+65536];
-	int readlen;
-private:
-	int readpos = 0;
-public:
-	bool read() {
+	// what's still to be sent, in order, and what's still to be
+	// scheduled
+	OutQueue outq;
+	OutQueue channels[CHANNELS];
+	long deficit[CHANNELS] = {};
+	// has FEATURE_WORLD_PACKETS
+	bool world_packets = false;
+	// bulk that can still be sent, and when that was
+	long bulk_allowance = bulk_per_tick;
+	uint64_t bulk_time = 0;
+	bool throttled = false;
+	bool queue_check = false;
+	bool congested = false;
+	// being disconnected for being too slow
+	bool closing = false;
+	// when it became congested, or when closing gives up
+	uint64_t slow_since, close_by;
+	// the most queued since the last report
+	size_t peak = 0;
+	FrameReader reader;
+	// in ready_conns, and how many packets it can still have this poll
+	// cycle, and at its packet_rate as of read_time
+	bool ready = false;
+	int read_budget = 0;
+	double read_allowance = packet_rate;
+	uint64_t read_time = 0;
+	// since the last report: packets read, and how many times it was
+	// held back by packets_per_poll and by packet_rate
+	uint64_t packets_read = 0;
+	int deferred = 0, rate_limited = 0;
+#ifdef RSGAME_HAVE_URING
+	// with io_uring, the connection's index in RingPoll::slots. What is
+	// received goes straight into reader
+	int slot = -1;
+	bool received_eof = false;
+	// in RingPoll::readable this cycle
+	bool readable = false;
+#endif
+	// the connection is closed at the end of the poll cycle
+	void kill() {
+		if (!dead) {
+			dead = true;
+			dead_conns.push_back(this);
+		}
+	}
+	// the next packet, length prefix and all, or null once there's
+	// nothing more to read for now
+	uint8_t *read(int &len) {
 		if (dead)
-			return false;
-		for (;;) {
-			if (readpos < 2) {
-				int r = net_read(sock, readbuf + readpos, 2 - readpos);
-				if (r == -1) {
-					if (net_again()) {
-						return false;
-					} else {
-						net_perror("read");
-						dead = true;
-						return false;
-					}
-				} else if (r == 0) {
-					fprintf(stderr, "read: returned 0\n");
-					dead = true;
-					return false;
-				} else {
-					readpos += r;
+			return nullptr;
+		uint8_t *p;
+#ifdef RSGAME_HAVE_URING
+		if (slot != -1) {
+			if (!(p = reader.next(len)) && received_eof) {
+				fprintf(stderr, "read: returned 0\n");
+				kill();
+			}
+			return p;
+		}
+#endif
+		if ((p = reader.read(sock, len)))
+			return p;
+		if (reader.last == 0) {
+			fprintf(stderr, "read: returned 0\n");
+			kill();
+		} else if (reader.last == -1 && !net_again()) {
+			net_perror("read");
+			kill();
+		}
+		return nullptr;
+	}
+	// what isn't the world, or waiting for it to be sent. Once it is,
+	// what piled up behind it counts, and the client gets
+	// --slow-client-timeout to catch up like anyone else
+	size_t queued() const {
+		if (!logged_in)
+			return 0;
+		size_t n = 0;
+		for (int c = 0; c < CH_BULK; c++)
+			if (!held(c))
+				n += channels[c].bytes();
+		return n;
+	}
+	void check_queue() {
+		if (!queue_check) {
+			queue_check = true;
+			queue_checks.push_back(this);
+		}
+	}
+	bool held(int c) const {
+		return !channels[CH_BULK].empty() &&
+			(c == CH_BLOCKS || (c == CH_ENTITY && !world_packets));
+	}
+	void schedule() {
+		size_t size = outq.bytes();
+		if (size >= commit_size)
+			return;
+		bool moved = false;
+		while (!channels[CH_CONTROL].empty()) {
+			size += channels[CH_CONTROL].front()->size();
+			channels[CH_CONTROL].move_front(outq);
+			moved = true;
+		}
+		OutQueue &bulk = channels[CH_BULK];
+		if (!bulk.empty()) {
+			uint64_t now = time_ticks();
+			bulk_allowance = std::min((long)bulk_per_tick,
+				bulk_allowance + (long)((now - bulk_time) * bulk_per_tick / 50));
+			bulk_time = now;
+		}
+		while (size < commit_size) {
+			// rounds go on while there's something that can go, if
+			// only to build up its deficit
+			bool waiting = false;
+			for (int c = CH_ENTITY; c < CHANNELS; c++) {
+				OutQueue &ch = channels[c];
+				if (ch.empty() || held(c)) {
+					deficit[c] = 0;
+					continue;
 				}
-			} else {
-				int plen = readbuf[0] << 8 | readbuf[1];
-				int r = net_read(sock, readbuf + readpos, 2 + plen - readpos);
-				if (r == -1) {
-					if (net_again()) {
-						return false;
-					} else {
-						net_perror("read");
-						dead = true;
-						return false;
-					}
-				} else if (r == 0) {
-					fprintf(stderr, "read: returned 0\n");
-					dead = true;
-					return false;
-				} else {
-					readpos += r;
-					if (readpos == 2 + plen) {
-						readlen = 2 + plen;
-						readpos = 0;
-						return true;
+				if (c == CH_BULK && bulk_allowance <= 0)
+					continue;
+				waiting = true;
+				deficit[c] += channel_quantum[c];
+				while (!ch.empty() && deficit[c] > 0 && size < commit_size) {
+					size_t n = ch.front()->size();
+					if (c == CH_BULK) {
+						if (bulk_allowance <= 0)
+							break;
+						bulk_allowance -= n;
 					}
+					ch.move_front(outq);
+					deficit[c] -= n;
+					size += n;
+					moved = true;
 				}
 			}
+			if (!waiting)
+				break;
+		}
+		if (moved)
+			check_queue();
+		if (!bulk.empty() && bulk_allowance <= 0 && !throttled) {
+			throttled = true;
+			throttled_conns.push_back(this);
 		}
 	}
-	void write(const uint8_t *buf, int len) {
-		if (dead)
+	// starts on what there is to send
+	void resume() {
+#ifdef RSGAME_HAVE_URING
+		// sent by process_writes
+		if (slot != -1)
+			return write_blocked(this);
+#endif
+		flush();
+		if (!outq.empty())
+			write_blocked(this);
+	}
+	void write(const SharedBuffer &buf, Channel c) {
+		if (dead || closing || buf->empty())
 			return;
-		for (;;) {
-			if (!writebuf.size()) {
-				if (len) {
-					int r = net_write(sock, buf, len);
-					if (r == -1) {
-						if (net_again()) {
-							writebuf.resize(len);
-							memcpy(writebuf.data(), buf, len);
-						} else {
-							net_perror("write");
-							dead = true;
-						}
-						return;
-					} else {
-						assert(r);
-						if (r == len)
-							return;
-						buf += r;
-						len -= r;
-					}
-				} else {
-					return;
+		channels[c].push(buf);
+		check_queue();
+		// otherwise it's waiting for the socket already
+		if (outq.empty())
+			resume();
+	}
+	// writes as much as the socket takes
+	void flush() {
+		net_iovec iov[net_iov_max];
+		while (!dead) {
+			schedule();
+			if (outq.empty())
+				return;
+			size_t len;
+			int r = net_writev(sock, iov, outq.gather(iov, net_iov_max, len));
+			if (r == -1) {
+				if (!net_again()) {
+					net_perror("write");
+					kill();
 				}
+				return;
+			}
+			assert(r);
+			outq.consume(r);
+			// the socket is full
+			if ((size_t)r < len)
+				return;
+		}
+	}
+	bool has_output() const {
+		for (auto &ch : channels)
+			if (!ch.empty())
+				return true;
+		return !outq.empty();
+	}
+	void drop_unsent() {
+		outq.drop_unsent();
+		for (auto &ch : channels)
+			ch.drop_unsent();
+	}
+	void send(const PacketWriter &pw) {
+		write(std::make_shared<const std::vector<uint8_t>>(pw.buf, pw.buf + pw.finish()), CH_CONTROL);
+	}
+};
+thread_local std::vector<Connection*> conns;
+thread_local std::unordered_map<int, Connection*> joined_conns;
+/* Each poll cycle of a network thread looks like so:
+ * - poll
+ * - read packets and pass them on to the simulation
+ * - write what the simulation sent
+ * - flush write buffers
+ * - accept new connections, and take the ones handed to this thread
+ * - close connections that were killed
+ */
+#ifdef RSGAME_HAVE_URING
+/* The io_uring version is used with --io-uring, if the kernel supports
+ * it. Accepts and recvs are multishot, so they are submitted once and
+ * then keep completing. Received data lands in a ring of provided
+ * buffers and is copied into the connection's FrameReader, where
+ * read() takes packets from. Writes only queue their buffer, and
+ * process_writes starts a send for each connection with something to
+ * send. Those sends are submitted by the same io_uring_enter that waits
+ * for the next cycle's completions, so a cycle is usually one syscall.
+ * Sends are sendmsgs over up to send_iovs buffers of the connection's
+ * queue at a time.
+ * Operations carry their slot and kind in user_data. A slot isn't reused
+ * until everything submitted for it has completed, since a send may
+ * still be reading from the slot's buffers after the connection is gone.
+ * For the same reason slots never move, the kernel may read the msghdr
+ * of a send after more slots have been added.
+ * A recv keeps going whether or not the connection is being read, so
+ * once its reader holds recv_limit it's cancelled, and it's only armed
+ * again when the reader is down to half of that. That's still more than
+ * a packet, so there's always a whole packet to read before then.
+ */
+struct RingPoll {
+	enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_CANCEL };
+	enum { send_iovs = 64, recv_limit = 256*1024 };
+	struct Slot {
+		Connection *conn = nullptr;
+		int ops = 0;
+		// the recv is being cancelled, or has been and is waiting in
+		// paused to be armed again
+		bool cancelling = false, paused = false;
+		// what the send in flight is for, and what of it is left from
+		// iov[next_iov] on
+		std::vector<SharedBuffer> sending;
+		iovec iov[send_iovs];
+		int iovs = 0, next_iov = 0;
+		msghdr msg;
+		void done_sending() {
+			sending.clear();
+			iovs = next_iov = 0;
+		}
+	};
+	Uring ring;
+	int listenfd;
+	bool accepting = false;
+	std::deque<Slot> slots;
+	std::vector<int> free_slots, paused;
+	std::vector<Connection*> readable, writable;
+	std::vector<int> accepted;
+	size_t next_read = 0, next_accept = 0;
+	bool start(int listenfd) {
+		this->listenfd = listenfd;
+		if (!ring.init(4096, 16384) || !ring.provide_buffers(1024, 4096))
+			return false;
+		return listenfd == -1 || (accepting = arm_accept());
+	}
+	bool arm_accept() {
+		io_uring_sqe *sqe = ring.sqe();
+		if (!sqe)
+			return false;
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = listenfd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = OP_ACCEPT;
+		return true;
+	}
+	void arm_recv(int i) {
+		Slot &s = slots[i];
+		io_uring_sqe *sqe = ring.sqe();
+		if (!sqe) {
+			fprintf(stderr, "io_uring: submission queue full\n");
+			s.conn->kill();
+			return;
+		}
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = s.conn->sock;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = (uint64_t)i << 8 | OP_RECV;
+		s.ops++;
+	}
+	void cancel_recv(int i) {
+		Slot &s = slots[i];
+		io_uring_sqe *sqe = ring.sqe();
+		if (!sqe) {
+			fprintf(stderr, "io_uring: submission queue full\n");
+			s.conn->kill();
+			return;
+		}
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t)i << 8 | OP_RECV;
+		sqe->user_data = (uint64_t)i << 8 | OP_CANCEL;
+		s.cancelling = true;
+		s.ops++;
+	}
+	void start_send(int i) {
+		Slot &s = slots[i];
+		io_uring_sqe *sqe = ring.sqe();
+		if (!sqe) {
+			fprintf(stderr, "io_uring: submission queue full\n");
+			s.conn->kill();
+			return;
+		}
+		memset(&s.msg, 0, sizeof(s.msg));
+		s.msg.msg_iov = &s.iov[s.next_iov];
+		s.msg.msg_iovlen = s.iovs - s.next_iov;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = s.conn->sock;
+		sqe->addr = (uint64_t)(uintptr_t)&s.msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = (uint64_t)i << 8 | OP_SEND;
+		s.ops++;
+	}
+	void poll(int timeout) {
+		if (!accepting && listenfd != -1)
+			accepting = arm_accept();
+		size_t kept = 0;
+		for (int i : paused) {
+			Slot &s = slots[i];
+			if (!s.paused || s.conn->dead)
+				continue;
+			if (s.conn->reader.buffered() >= recv_limit / 2) {
+				paused[kept++] = i;
+				continue;
+			}
+			s.paused = false;
+			arm_recv(i);
+		}
+		paused.resize(kept);
+		ring.submit(timeout);
+		readable.clear();
+		next_read = 0;
+		while (io_uring_cqe *cqe = ring.cqe()) {
+			complete(*cqe);
+			ring.pop();
+		}
+	}
+	void complete(const io_uring_cqe &cqe) {
+		int op = cqe.user_data & 255;
+		bool more = cqe.flags & IORING_CQE_F_MORE;
+		if (op == OP_ACCEPT) {
+			if (cqe.res >= 0) {
+				accepted.push_back(cqe.res);
 			} else {
-				int r = net_write(sock, writebuf.data(), writebuf.size());
-				if (r == -1) {
-					if (net_again()) {
-						writebuf.resize(writebuf.size() + len);
-						memcpy(writebuf.data() + writebuf.size(), buf, len);
+				errno = -cqe.res;
+				perror("accept");
+			}
+			if (!more)
+				accepting = arm_accept();
+			return;
+		}
+		int i = cqe.user_data >> 8;
+		Slot &s = slots[i];
+		Connection *conn = s.conn;
+		if (op == OP_RECV) {
+			if (cqe.flags & IORING_CQE_F_BUFFER) {
+				uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				if (conn && cqe.res > 0) {
+					mark_readable(conn);
+					conn->reader.append(ring.buffer(id), cqe.res);
+					if (more && !s.cancelling && conn->reader.buffered() >= recv_limit)
+						cancel_recv(i);
+				}
+				ring.return_buffer(id);
+			}
+			if (more)
+				return;
+			s.ops--;
+			if (conn && !conn->dead) {
+				if (cqe.res == 0) {
+					mark_readable(conn);
+					conn->received_eof = true;
+				} else if (cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED) {
+					// stopped early, for example because all the
+					// buffers were in use, or cancelled
+					if (conn->reader.buffered() >= recv_limit / 2) {
+						s.paused = true;
+						paused.push_back(i);
 					} else {
-						net_perror("write");
-						dead = true;
+						arm_recv(i);
 					}
-					return;
 				} else {
-					assert(r);
-					if (r != (int)writebuf.size()) {
-						memmove(writebuf.data(), writebuf.data()+r, writebuf.size() - r);
-						writebuf.resize(writebuf.size() - r);
+					errno = -cqe.res;
+					perror("recv");
+					conn->kill();
+				}
+			}
+		} else if (op == OP_CANCEL) {
+			// the recv may have ended by itself already
+			s.ops--;
+			s.cancelling = false;
+		} else {
+			s.ops--;
+			if (conn && !conn->dead) {
+				if (cqe.res < 0) {
+					errno = -cqe.res;
+					perror("send");
+					conn->kill();
+				} else {
+					size_t sent = cqe.res;
+					while (s.next_iov < s.iovs && sent >= s.iov[s.next_iov].iov_len)
+						sent -= s.iov[s.next_iov++].iov_len;
+					if (s.next_iov < s.iovs) {
+						iovec &iov = s.iov[s.next_iov];
+						iov.iov_base = (uint8_t *)iov.iov_base + sent;
+						iov.iov_len -= sent;
+						start_send(i);
 					} else {
-						writebuf.clear();
+						s.done_sending();
+						if (conn->has_output())
+							writable.push_back(conn);
 					}
 				}
 			}
 		}
+		if (!conn && !s.ops) {
+			s.done_sending();
+			free_slots.push_back(i);
+		}
 	}
-	void send(const PacketWriter &pw) {
-		pw.buf[0] = (pw.pos-2)>>16;
-		pw.buf[1] = (pw.pos-2);
-		write(pw.buf, pw.pos);
+	void mark_readable(Connection *conn) {
+		if (!conn->readable) {
+			conn->readable = true;
+			readable.push_back(conn);
+		}
+	}
+	Connection *next_to_read() {
+		if (next_read == readable.size())
+			return nullptr;
+		readable[next_read]->readable = false;
+		return readable[next_read++];
+	}
+	int accept() {
+		if (next_accept == accepted.size()) {
+			accepted.clear();
+			next_accept = 0;
+			errno = EAGAIN;
+			return -1;
+		}
+		return accepted[next_accept++];
+	}
+	void process_writes() {
+		for (Connection *conn : writable) {
+			Slot &s = slots[conn->slot];
+			if (conn->dead || s.iovs)
+				continue;
+			conn->schedule();
+			if (conn->outq.empty())
+				continue;
+			size_t len;
+			s.iovs = conn->outq.gather(s.iov, send_iovs, len);
+			conn->outq.take(s.iovs, s.sending);
+			conn->check_queue();
+			start_send(conn->slot);
+		}
+		writable.clear();
+	}
+	void add_conn(Connection *conn) {
+		int i;
+		if (free_slots.size()) {
+			i = free_slots.back();
+			free_slots.pop_back();
+		} else {
+			i = slots.size();
+			slots.emplace_back();
+		}
+		slots[i].conn = conn;
+		conn->slot = i;
+		arm_recv(i);
+	}
+	void del_conn(Connection *conn) {
+		Slot &s = slots[conn->slot];
+		s.conn = nullptr;
+		s.paused = false;
+		// makes whatever is still submitted for it complete
+		shutdown(conn->sock, SHUT_RDWR);
+		if (!s.ops) {
+			s.done_sending();
+			free_slots.push_back(conn->slot);
+		}
 	}
 };
-std::vector<Connection*> conns;
-bool new_joins_this_tick = false;
-/* Each poll cycle looks like so:
- * - poll
- * - read and process packets
- * - flush write buffers
- * - accept new connections
- * - close connections marked as dead
+#endif
+#if defined(__linux__)
+/* The epoll version is edge-triggered, so a cycle only touches the
+ * connections that have something to do. That works out because reads
+ * and accepts always go on until EAGAIN (or until the connection is
+ * dead and about to be closed anyway). EPOLLOUT is only asked for while
+ * a connection has a write buffer to flush, so sockets don't keep
+ * reporting that they're writable.
+ * The only limit on connections is the open file limit, which is raised
+ * as far as it goes.
  */
-#ifndef WIN32
+struct Poll {
+	int epfd = -1;
+	int listenfd;
+	bool needs_accept = false;
+	size_t max_conns = 0;
+	std::vector<epoll_event> events = std::vector<epoll_event>(64);
+	int nevents = 0;
+#ifdef RSGAME_HAVE_URING
+	bool use_uring = false;
+	std::unique_ptr<RingPoll> ring;
+#endif
+	bool start(int listenfd) {
+		this->listenfd = listenfd;
+		struct rlimit rl;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+			perror("getrlimit");
+			return false;
+		}
+		if (rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+				perror("setrlimit");
+			getrlimit(RLIMIT_NOFILE, &rl);
+		}
+		// leave some room for the world and journal files, and for
+		// accepting a connection just to tell it the server is busy
+		max_conns = rl.rlim_cur > 64 ? rl.rlim_cur - 64 : 0;
+#ifdef RSGAME_HAVE_URING
+		if (use_uring) {
+			ring.reset(new RingPoll);
+			if (ring->start(listenfd))
+				return true;
+			fprintf(stderr, "Can't use io_uring, falling back to epoll\n");
+			ring.reset();
+		}
+#endif
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1) {
+			perror("epoll_create1");
+			return false;
+		}
+		if (listenfd == -1)
+			return true;
+		epoll_event ev;
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = nullptr;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+			perror("epoll_ctl");
+			return false;
+		}
+		// the listening socket may have become readable before it was
+		// added, edge-triggered epoll wouldn't report that
+		needs_accept = true;
+		return true;
+	}
+	// the file limit is shared by all threads
+	bool can_accept() {
+		return open_conns < max_conns;
+	}
+	void poll(int timeout) {
+#ifdef RSGAME_HAVE_URING
+		if (ring) {
+			ring->poll(timeout);
+			needs_accept = ring->accepted.size();
+			return;
+		}
+#endif
+		if (nevents == (int)events.size())
+			events.resize(events.size() * 2);
+		nevents = epoll_wait(epfd, events.data(), events.size(), timeout);
+		if (nevents == -1) {
+			if (errno != EINTR)
+				perror("epoll_wait");
+			nevents = 0;
+		}
+		for (int i = 0; i < nevents; i++)
+			if (!events[i].data.ptr)
+				needs_accept = true;
+		next_index = 0;
+	}
+	int next_index;
+	Connection *next_to_read() {
+#ifdef RSGAME_HAVE_URING
+		if (ring)
+			return ring->next_to_read();
+#endif
+		while (next_index < nevents) {
+			epoll_event &ev = events[next_index++];
+			if (ev.data.ptr && ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				return (Connection *)ev.data.ptr;
+		}
+		return nullptr;
+	}
+	int accept() {
+#ifdef RSGAME_HAVE_URING
+		if (ring)
+			return ring->accept();
+#endif
+		return ::accept(listenfd, NULL, NULL);
+	}
+	void process_writes() {
+#ifdef RSGAME_HAVE_URING
+		if (ring)
+			return ring->process_writes();
+#endif
+		for (int i = 0; i < nevents; i++) {
+			Connection *conn = (Connection *)events[i].data.ptr;
+			if (conn && events[i].events & EPOLLOUT && conn->has_output()) {
+				conn->flush();
+				if (conn->outq.empty())
+					watch(conn, EPOLL_CTL_MOD, EPOLLIN);
+			}
+		}
+	}
+	void watch(Connection *conn, int op, uint32_t events) {
+		epoll_event ev;
+		ev.events = events | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, op, conn->sock, &ev) == -1) {
+			perror("epoll_ctl");
+			conn->kill();
+		}
+	}
+	void write_blocked(Connection *conn) {
+#ifdef RSGAME_HAVE_URING
+		if (ring)
+			return ring->writable.push_back(conn);
+#endif
+		watch(conn, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+	}
+	void add_conn(Connection *conn) {
+#ifdef RSGAME_HAVE_URING
+		if (ring)
+			return ring->add_conn(conn);
+#endif
+		watch(conn, EPOLL_CTL_ADD, EPOLLIN);
+	}
+	void del_conn(Connection *conn) {
+#ifdef RSGAME_HAVE_URING
+		if (ring)
+			return ring->del_conn(conn);
+#endif
+		epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sock, nullptr);
+	}
+};
+#elif !defined(WIN32)
 struct Poll {
 	struct pollfd pollfds[256];
 	int listenfd;
 	bool needs_accept = false;
+	bool start(int listenfd) {
+		this->listenfd = listenfd;
+		return true;
+	}
 	bool can_accept() {
 		return 1+conns.size() < 256;
 	}
-	void poll() {
+	void poll(int timeout) {
 		pollfds[0].fd = listenfd;
 		pollfds[0].events = POLLIN;
 		for (size_t i = 0; i < conns.size(); i++) {
 			pollfds[i+1].fd = conns[i]->sock;
-			pollfds[i+1].events = conns[i]->writebuf.size() ? POLLIN | POLLOUT : POLLIN;
+			pollfds[i+1].events = conns[i]->outq.empty() ? POLLIN : POLLIN | POLLOUT;
 		}
-		::poll(pollfds, conns.size() + 1, 1);
+		::poll(pollfds, conns.size() + 1, timeout);
 		needs_accept = pollfds[0].revents & POLLIN;
 		next_index = 1;
 	}
@@ -189,13 +956,19 @@ struct Poll {
 		}
 		return nullptr;
 	}
+	int accept() {
+		return ::accept(listenfd, NULL, NULL);
+	}
 	void process_writes() {
 		for (size_t i = 1; i < conns.size() + 1; i++) {
 			if (pollfds[i].revents & POLLOUT) {
-				conns[i-1]->write(0, 0);
+				conns[i-1]->flush();
 			}
 		}
 	}
+	void write_blocked(Connection *conn) {
+		(void)conn;
+	}
 	void add_conn(Connection *conn) {
 		(void)conn;
 	}
@@ -209,29 +982,39 @@ struct Poll {
 	fd_set readfds, writefds;
 	int listenfd;
 	bool needs_accept = false;
+	bool start(int listenfd) {
+		this->listenfd = listenfd;
+		return true;
+	}
 	bool can_accept() {
 		return 1+conns.size() < FD_SETSIZE;
 	}
-	void poll() {
+	void poll(int timeout) {
 		readfds.fd_count = 0;
 		writefds.fd_count = 0;
-		readfds.fd_array[readfds.fd_count++] = listenfd;
+		if (listenfd != -1)
+			readfds.fd_array[readfds.fd_count++] = listenfd;
 		for (size_t i = 0; i < conns.size(); i++) {
 			readfds.fd_array[readfds.fd_count++] = conns[i]->sock;
-			if (conns[i]->writebuf.size())
+			if (!conns[i]->outq.empty())
 				writefds.fd_array[writefds.fd_count++] = conns[i]->sock;
 		}
+		// the simulation's messages are only picked up between polls
 		timeval tv;
-		tv.tv_sec = 2;
-		tv.tv_usec = 0;
-		select(0, &readfds, &writefds, 0, &tv);
+		tv.tv_sec = 0;
+		tv.tv_usec = timeout * 1000;
+		// winsock doesn't take empty sets
+		if (readfds.fd_count)
+			select(0, &readfds, &writefds, 0, &tv);
+		else
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
 		needs_accept = false;
 		next_index = 0;
 	}
 	size_t next_index;
 	Connection *next_to_read() {
 		while (next_index++ < readfds.fd_count) {
-			if (readfds.fd_array[next_index-1] == (SOCKET)listenfd) {
+			if (listenfd != -1 && readfds.fd_array[next_index-1] == (SOCKET)listenfd) {
 				needs_accept = true;
 			} else {
 				auto it = sock_to_conn.find(readfds.fd_array[next_index-1]);
@@ -242,14 +1025,20 @@ struct Poll {
 		}
 		return nullptr;
 	}
+	int accept() {
+		return ::accept(listenfd, NULL, NULL);
+	}
 	void process_writes() {
 		for (size_t i = 0; i < writefds.fd_count; i++) {
 			auto it = sock_to_conn.find(writefds.fd_array[i]);
 			assert(it != sock_to_conn.end());
 			if (it != sock_to_conn.end())
-				it->second->write(0, 0);
+				it->second->flush();
 		}
 	}
+	void write_blocked(Connection *conn) {
+		(void)conn;
+	}
 	void add_conn(Connection *conn) {
 		sock_to_conn.emplace(conn->sock, conn);
 	}
@@ -258,13 +1047,19 @@ struct Poll {
 	}
 };
 #endif
-Poll poller;
+thread_local Poll poller;
+void write_blocked(Connection *conn) {
+	poller.write_blocked(conn);
+}
 void accept_connections() {
+	// only the first network thread ever has anything to accept
+	static size_t next_thread = 0;
 	if (poller.needs_accept) {
 		for (;;) {
-			int sock = accept(poller.listenfd, NULL, NULL);
+			int sock = poller.accept();
 			if (sock == -1) {
 				if (net_again()) {
+					poller.needs_accept = false;
 					break;
 				} else {
 					net_perror("accept");
@@ -276,41 +1071,344 @@ void accept_connections() {
 				net_close(sock);
 				continue;
 			}
-			if (!poller.can_accept()) {
-				net_write(sock, "\x00\x0C\x02Server Busy", 14);
-				net_close(sock);
-			} else {
-				Connection *conn = new Connection(sock);
-				poller.add_conn(conn);
-				conns.push_back(conn);
-			}
+#ifdef TCP_NOTSENT_LOWAT
+			// the socket only takes a little more than is in flight, so
+			// what's waiting stays in the channels, where it can still
+			// be scheduled
+			int lowat = notsent_lowat;
+			net_setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(int));
+#endif
+			io_threads[next_thread++ % io_threads.size()]->new_socks.push(sock);
+		}
+	}
+}
+void add_new_connections() {
+	int sock;
+	while (io_self->new_socks.pop(sock)) {
+		if (!poller.can_accept()) {
+			net_write(sock, "\x00\x0C\x02Server Busy", 14);
+			net_close(sock);
+		} else {
+			Connection *conn = new Connection(sock);
+			open_conns++;
+			poller.add_conn(conn);
+			conns.push_back(conn);
 		}
 	}
 }
 void close_dead_connections() {
-	for (size_t i = 0; i < conns.size(); i++) {
-		Connection *conn = conns[i];
-		if (conn->dead) {
-			if (conn->logged_in) {
-				uint8_t pbuf[2+5];
-				PacketWriter pw(pbuf);
-				pw.write8(S_EntityLeave);
-				pw.write32(conn->eid);
-				for (Connection *conn : conns)
-					if (conn->logged_in)
-						conn->send(pw);
+	for (size_t i = 0; i < dead_conns.size(); i++) {
+		Connection *conn = dead_conns[i];
+		if (conn->joined) {
+			ClientEvent ev = ClientEvent();
+			ev.type = ClientEvent::LEAVE;
+			ev.eid = conn->eid;
+			io_self->events.push(ev);
+			joined_conns.erase(conn->eid);
+		}
+		if (conn->congested || conn->closing)
+			slow_conns.erase(std::find(slow_conns.begin(), slow_conns.end(), conn));
+		if (conn->throttled)
+			throttled_conns.erase(std::find(throttled_conns.begin(), throttled_conns.end(), conn));
+		if (conn->ready)
+			ready_conns.erase(std::find(ready_conns.begin(), ready_conns.end(), conn));
+		poller.del_conn(conn);
+		net_close(conn->sock);
+		open_conns--;
+		conns.erase(std::find(conns.begin(), conns.end(), conn));
+		delete conn;
+	}
+	dead_conns.clear();
+}
+void handle_packet(Connection *conn, uint8_t *packet, int len) {
+	int plen = len - 2;
+	PacketReader pr(packet + 2);
+	ClientEvent ev = ClientEvent();
+	ev.eid = conn->eid;
+	if (!conn->joined) {
+		if ((plen != 5 && plen != 9) || pr.read8() != C_ClientIntroduction ||
+				((ev.proto = pr.read32()) != RSGAME_NETPROTO && ev.proto != RSGAME_NETPROTO_STREAM) ||
+				(plen == 9 && ev.proto != RSGAME_NETPROTO)) {
+			uint8_t pbuf[2+21];
+			conn->send(PacketWriter(pbuf)
+				.write8(B_Disconnect)
+				.write_str("Bad proto", 9));
+			conn->kill();
+			return;
+		}
+		conn->joined = true;
+		joined_conns.emplace(conn->eid, conn);
+		ev.type = ClientEvent::JOIN;
+		ev.features = plen == 9 ? pr.read32() & server_features : -1;
+		conn->world_packets = plen == 9 && ev.features & FEATURE_WORLD_PACKETS;
+		io_self->events.push(ev);
+		return;
+	}
+	if (plen == 0)
+		return;
+	switch (pr.read8()) {
+	case B_Disconnect: {
+		fprintf(stderr, "Disconnected: %.*s\n", plen-1, &packet[3]);
+		conn->kill();
+		break;
+	}
+	case C_ChangePosition: {
+		if (plen < 17)
+			break;
+		ev.type = ClientEvent::POSITION;
+		ev.x = pr.read32();
+		ev.y = pr.read32();
+		ev.z = pr.read32();
+		ev.yaw = pr.read16();
+		ev.pitch = pr.read16();
+		io_self->events.push(ev);
+		break;
+	}
+	case C_ChangeBlock: {
+		if (plen < 8)
+			break;
+		ev.type = ClientEvent::BLOCK;
+		ev.index = pr.read32();
+		ev.old_id = pr.read8();
+		ev.old_data = pr.read8();
+		ev.new_id = pr.read8();
+		ev.new_data = pr.read8();
+		io_self->events.push(ev);
+		break;
+	}
+	}
+}
+void read_packets() {
+	while (Connection *conn = poller.next_to_read()) {
+		if (!conn->ready) {
+			conn->ready = true;
+			ready_conns.push_back(conn);
+		}
+	}
+	uint64_t now = time_ticks();
+	for (Connection *conn : ready_conns) {
+		conn->read_budget = packets_per_poll;
+		conn->read_allowance = std::min((double)packet_rate,
+			conn->read_allowance + (now - conn->read_time) * packet_rate / 1000.0);
+		conn->read_time = now;
+	}
+	bool more = true;
+	while (more) {
+		more = false;
+		for (Connection *conn : ready_conns) {
+			int n = std::min(read_quantum, std::min(conn->read_budget, (int)conn->read_allowance));
+			for (int i = 0; i < n && conn->ready; i++) {
+				int len;
+				uint8_t *packet = conn->read(len);
+				if (!packet) {
+					conn->ready = false;
+					break;
+				}
+				conn->read_budget--;
+				conn->read_allowance--;
+				conn->packets_read++;
+				handle_packet(conn, packet, len);
 			}
-			poller.del_conn(conn);
-			net_close(conn->sock);
-			delete conn;
-			conns.erase(conns.begin()+i);
-			i--;
+			if (conn->ready && n == read_quantum && conn->read_budget && conn->read_allowance >= 1)
+				more = true;
+		}
+	}
+	reads_left = false;
+	size_t kept = 0;
+	for (Connection *conn : ready_conns) {
+		if (!conn->ready)
+			continue;
+		if (conn->read_allowance < 1) {
+			conn->rate_limited++;
+		} else {
+			conn->deferred++;
+			reads_left = true;
+		}
+		ready_conns[kept++] = conn;
+	}
+	ready_conns.resize(kept);
+}
+void deliver_messages() {
+	ServerMessage m;
+	while (io_self->messages.pop(m)) {
+		// it may have left since
+		auto it = joined_conns.find(m.eid);
+		if (it == joined_conns.end())
+			continue;
+		if (m.type == ServerMessage::LOGIN)
+			it->second->logged_in = true;
+		it->second->write(m.data, m.channel);
+	}
+}
+// gives connections that were out of bulk allowance another go
+void resume_throttled() {
+	if (throttled_conns.empty())
+		return;
+	std::vector<Connection*> resumed;
+	resumed.swap(throttled_conns);
+	for (Connection *conn : resumed) {
+		conn->throttled = false;
+		if (!conn->dead)
+			conn->resume();
+	}
+}
+void push_event(Connection *conn, int type) {
+	ClientEvent ev = ClientEvent();
+	ev.type = (decltype(ev.type))type;
+	ev.eid = conn->eid;
+	io_self->events.push(ev);
+}
+void check_queues() {
+	uint64_t now = time_ticks();
+	for (Connection *conn : queue_checks) {
+		conn->queue_check = false;
+		if (conn->dead || conn->closing)
+			continue;
+		size_t queued = conn->queued();
+		conn->peak = std::max(conn->peak, queued);
+		if (!conn->congested && queued > send_queue_limit) {
+			conn->congested = true;
+			conn->slow_since = now;
+			slow_conns.push_back(conn);
+			push_event(conn, ClientEvent::CONGESTED);
+		} else if (conn->congested && queued <= send_queue_limit / 2) {
+			conn->congested = false;
+			slow_conns.erase(std::find(slow_conns.begin(), slow_conns.end(), conn));
+			push_event(conn, ClientEvent::DRAINED);
+		}
+	}
+	queue_checks.clear();
+	for (Connection *conn : slow_conns) {
+		if (conn->dead)
+			continue;
+		if (conn->closing) {
+			if (!conn->has_output() || now >= conn->close_by)
+				conn->kill();
+		} else if (now - conn->slow_since >= (uint64_t)slow_client_timeout*1000) {
+			fprintf(stderr, "Player %d has %zu KiB queued after %d s, disconnecting\n",
+				conn->eid, conn->queued() / 1024, slow_client_timeout);
+			conn->drop_unsent();
+			uint8_t pbuf[2+9];
+			conn->send(PacketWriter(pbuf)
+				.write8(B_Disconnect)
+				.write_str("Too slow", 8));
+			conn->congested = false;
+			conn->closing = true;
+			conn->close_by = now + disconnect_linger_ms;
+			evicted++;
+		}
+	}
+}
+/* Every queue_report_ms each network thread prints how much its
+ * players had queued at most in that time, and how much they sent.
+ */
+const uint64_t queue_report_ms = 30000;
+thread_local uint64_t next_queue_report = queue_report_ms;
+void report_queues() {
+	uint64_t now = time_ticks();
+	if (now < next_queue_report)
+		return;
+	next_queue_report = now + queue_report_ms;
+	std::vector<std::pair<size_t, int>> peaks;
+	int congested = 0;
+	for (Connection *conn : conns) {
+		if (!conn->logged_in || conn->dead)
+			continue;
+		peaks.emplace_back(conn->peak, conn->eid);
+		congested += conn->congested;
+		conn->peak = conn->queued();
+	}
+	if (peaks.empty())
+		return;
+	std::sort(peaks.begin(), peaks.end());
+	auto kib = [&](double p) {
+		return peaks[std::min(peaks.size() - 1, (size_t)(peaks.size()*p))].first / 1024.0;
+	};
+	fprintf(stderr, "Send queues of %zu players: p50 %.1f KiB, p99 %.1f KiB, max %.1f KiB (player %d), %d congested, %d disconnected\n",
+		peaks.size(), kib(0.5), kib(0.99), peaks.back().first / 1024.0, peaks.back().second, congested, evicted);
+	evicted = 0;
+}
+thread_local uint64_t next_read_report = queue_report_ms;
+void report_reads() {
+	uint64_t now = time_ticks();
+	if (now < next_read_report)
+		return;
+	next_read_report = now + queue_report_ms;
+	uint64_t total = 0, most = 0;
+	int most_eid = -1, deferred = 0, rate_limited = 0;
+	for (Connection *conn : conns) {
+		total += conn->packets_read;
+		if (conn->packets_read > most) {
+			most = conn->packets_read;
+			most_eid = conn->eid;
 		}
+		deferred += conn->deferred > 0;
+		rate_limited += conn->rate_limited > 0;
+		conn->packets_read = 0;
+		conn->deferred = conn->rate_limited = 0;
+	}
+	if (!total)
+		return;
+	fprintf(stderr, "Read %llu packets, most from player %d (%.0f/s), %d deferred to the next poll, %d rate limited\n",
+		(unsigned long long)total, most_eid, most * 1000.0 / queue_report_ms, deferred, rate_limited);
+}
+#ifdef RSGAME_HAVE_URING
+bool use_uring = false;
+#endif
+void run_io_thread(IoThread *self, int listenfd) {
+	io_self = self;
+#ifdef RSGAME_HAVE_URING
+	poller.use_uring = use_uring;
+#endif
+	// io_uring wants the thread that submits to be the one that set it up
+	if (!poller.start(listenfd)) {
+		self->started.set_value(false);
+		return;
+	}
+	self->started.set_value(true);
+	while (!io_quit) {
+		poller.poll(reads_left ? 0 : 1);
+		read_packets();
+		deliver_messages();
+		poller.process_writes();
+		resume_throttled();
+		check_queues();
+		report_queues();
+		report_reads();
+		accept_connections();
+		add_new_connections();
+		close_dead_connections();
 	}
 }
+void stop_io_threads() {
+	io_quit = true;
+	for (auto &io : io_threads)
+		if (io->thread.joinable())
+			io->thread.join();
+}
+volatile sig_atomic_t quit_requested = 0;
+void on_quit_signal(int) {
+	quit_requested = 1;
+}
+const long checkpoint_ticks = 20*30;
+const auto tick_length = std::chrono::milliseconds(50);
 std::vector<ivec3> block_updates;
+// a bit for each block of the sections in block_updates, so a block
+// that changes several times in a tick is only sent once, as it ends up
+std::unordered_map<uint64_t, std::bitset<4096>> dirty_sections;
+// the level's size, set once it's loaded
+int level_xsize, level_zsize;
 void server_set_dirty(int x, int y, int z)
 {
+	// updates reach past the edge of the world, where there's nothing
+	// to send
+	if (x < 0 || x >= level_xsize || z < 0 || z >= level_zsize || y < 0 || y > 127)
+		return;
+	auto &dirty = dirty_sections[(uint64_t)(x >> 4) << 32 | (z >> 4) << 3 | y >> 4];
+	int i = (x&15) << 8 | (z&15) << 4 | (y&15);
+	if (dirty[i])
+		return;
+	dirty.set(i);
 	block_updates.emplace_back(x, y, z);
 }
 struct RenderLevel {
@@ -318,6 +1416,717 @@ struct RenderLevel {
 		server_set_dirty(x, y, z);
 	}
 };
+/* Everything below runs on the simulation thread */
+struct EntityState {
+	int x = 0, y = 0, z = 0;
+	short yaw = 0, pitch = 0;
+	bool operator==(const EntityState &o) const {
+		return x == o.x && y == o.y && z == o.z && yaw == o.yaw && pitch == o.pitch;
+	}
+};
+struct Player {
+	int eid;
+	IoThread *io;
+	// gets S_EntityDeltas, S_SectionUpdates
+	bool deltas, section_updates;
+	// where it is, and where it was as of its last update
+	EntityState now, sent;
+	// the cell it's in, see below
+	int cell = -1;
+	// the tick from which on it missed what changed in cells it didn't
+	// see: the one after it logged in, or for cells it saw before, the one
+	// they went out of view
+	long since;
+	std::unordered_map<int, long> left;
+	// its connection is too far behind, so it only gets S_EntityLeave.
+	// What it knows of the cells in its view is as of when it became
+	// congested, and once it's drained, resync has it get everything in
+	// view again like it just came into view
+	bool congested = false, resync = false;
+	// packets just for it, sent before the next tick's updates: entity
+	// packets, and block updates
+	std::vector<uint8_t> pending, pending_blocks;
+	// C_ChangeBlock not yet applied, see apply_edits
+	std::vector<ClientEvent> edits;
+};
+// players don't move, cells point to them
+std::vector<std::unique_ptr<Player>> players;
+std::unordered_map<int, size_t> player_index;
+void append(std::vector<uint8_t> &out, const PacketWriter &pw) {
+	out.insert(out.end(), pw.buf, pw.buf + pw.finish());
+}
+/* Area of interest. The world is divided into cells of a section column
+ * each, and players only hear about the cells within view_distance of
+ * theirs, a square so that seeing each other is mutual. A cell knows who
+ * is in it and who sees it, and its block and entity updates of a tick
+ * are built once and go to those that see it. When a cell comes into a
+ * player's view, the player gets S_EntityEnter for whoever is in it, and
+ * what changed there while it wasn't looking, S_EntityLeave for them
+ * when it goes out of view again.
+ * Small updates are copied into the pending packets of those who get
+ * them, so a player gets one message a tick and not one for each cell
+ * with something going on, bigger ones are shared.
+ */
+// in cells, see --view-distance
+int view_distance = 8;
+const size_t share_size = 1024;
+struct Cell {
+	std::vector<Player*> occupants, watchers;
+	// the tick each block in it last changed, by index
+	std::unordered_map<uint32_t, long> changed;
+	// this tick's block updates, and who moved
+	std::vector<uint32_t> blocks;
+	std::vector<Player*> movers;
+};
+int cells_x, cells_z;
+std::vector<Cell> cells;
+std::vector<int> dirty_cells;
+void init_cells(const Level &level) {
+	cells_x = (level.xsize + 15) / 16;
+	cells_z = (level.zsize + 15) / 16;
+	cells.resize(cells_x * cells_z);
+}
+// the cell of a block, or of what's past the edge of the world
+int cell_at(int x, int z) {
+	return std::min(std::max(z >> 4, 0), cells_z-1) * cells_x + std::min(std::max(x >> 4, 0), cells_x-1);
+}
+int cell_of(const Player &p) {
+	return cell_at(p.now.x >> 5, p.now.z >> 5);
+}
+bool in_view(int from, int cell) {
+	return from != -1 && abs(from % cells_x - cell % cells_x) <= view_distance &&
+		abs(from / cells_x - cell / cells_x) <= view_distance;
+}
+template<typename F>
+void for_view(int from, F f) {
+	if (from == -1)
+		return;
+	int x = from % cells_x, z = from / cells_x;
+	for (int cz = std::max(z - view_distance, 0); cz <= std::min(z + view_distance, cells_z-1); cz++)
+		for (int cx = std::max(x - view_distance, 0); cx <= std::min(x + view_distance, cells_x-1); cx++)
+			f(cz*cells_x + cx);
+}
+void write_update(PacketWriter &pw, int eid, const EntityState &s) {
+	pw.write32(eid);
+	pw.write32(s.x);
+	pw.write32(s.y);
+	pw.write32(s.z);
+	pw.write16(s.yaw);
+	pw.write16(s.pitch);
+}
+// nothing if from and to look the same
+void write_delta(PacketWriter &pw, int eid, const EntityState &from, const EntityState &to) {
+	uint8_t yaw = (uint16_t)to.yaw >> 8, pitch = (uint16_t)to.pitch >> 8;
+	int fields = (to.x != from.x ? DELTA_X : 0) |
+		(to.y != from.y ? DELTA_Y : 0) |
+		(to.z != from.z ? DELTA_Z : 0) |
+		(yaw != (uint16_t)from.yaw >> 8 ? DELTA_YAW : 0) |
+		(pitch != (uint16_t)from.pitch >> 8 ? DELTA_PITCH : 0);
+	if (!fields)
+		return;
+	pw.write_varint(eid);
+	pw.write8(fields);
+	if (fields & DELTA_X)
+		pw.write_svarint(to.x - from.x);
+	if (fields & DELTA_Y)
+		pw.write_svarint(to.y - from.y);
+	if (fields & DELTA_Z)
+		pw.write_svarint(to.z - from.z);
+	if (fields & DELTA_YAW)
+		pw.write8(yaw);
+	if (fields & DELTA_PITCH)
+		pw.write8(pitch);
+}
+// S_EntityEnter for p, and where it was as of its last update, since
+// the next one takes it from there
+void write_enter(std::vector<uint8_t> &out, const Player &p, bool deltas) {
+	uint8_t pbuf[2+entity_delta_max+20];
+	append(out, PacketWriter(pbuf)
+		.write8(S_EntityEnter)
+		.write32(p.eid));
+	PacketWriter pw(pbuf);
+	pw.write8(deltas ? S_EntityDeltas : S_EntityUpdates);
+	if (deltas)
+		write_delta(pw, p.eid, EntityState(), p.sent);
+	else
+		write_update(pw, p.eid, p.sent);
+	if (pw.pos > 3)
+		append(out, pw);
+}
+// the S_EntityUpdates or S_EntityDeltas of the players that moved
+void write_moves(std::vector<uint8_t> &out, const std::vector<Player*> &movers, bool deltas) {
+	uint8_t pbuf[65536];
+	for (auto it = movers.begin(); it != movers.end(); ) {
+		PacketWriter pw(pbuf);
+		pw.write8(deltas ? S_EntityDeltas : S_EntityUpdates);
+		while (pw.pos < 65536 - entity_delta_max && it != movers.end()) {
+			Player &p = **it++;
+			if (deltas)
+				write_delta(pw, p.eid, p.sent, p.now);
+			else
+				write_update(pw, p.eid, p.now);
+		}
+		if (pw.pos > 3)
+			append(out, pw);
+	}
+}
+void write_leave(std::vector<uint8_t> &out, int eid) {
+	uint8_t pbuf[2+5];
+	append(out, PacketWriter(pbuf)
+		.write8(S_EntityLeave)
+		.write32(eid));
+}
+// S_BlockUpdates with what is at the indices now
+void write_blocks(Level &level, std::vector<uint8_t> &out, const std::vector<uint32_t> &indices) {
+	uint8_t pbuf[65536];
+	for (auto it = indices.begin(); it != indices.end(); ) {
+		PacketWriter pw(pbuf);
+		pw.write8(S_BlockUpdates);
+		while (pw.pos < 65536 - 6 && it != indices.end()) {
+			if (*it == (uint32_t)-1) {
+				++it;
+				continue;
+			}
+			ivec3 pos = level.index_to_pos(*it);
+			pw.write32(*it++);
+			pw.write8(level.get_tile_id(pos.x, pos.y, pos.z));
+			pw.write8(level.get_tile_meta(pos.x, pos.y, pos.z));
+		}
+		append(out, pw);
+	}
+}
+// the same as S_SectionUpdates
+void write_section_updates(Level &level, std::vector<uint8_t> &out, const std::vector<uint32_t> &indices) {
+	int zsections = (level.zsize + 15) / 16;
+	// section << 12 | offset, in order
+	std::vector<uint64_t> keys;
+	keys.reserve(indices.size());
+	for (uint32_t index : indices) {
+		if (index == (uint32_t)-1)
+			continue;
+		ivec3 pos = level.index_to_pos(index);
+		uint64_t section = ((uint64_t)(pos.x >> 4)*zsections + (pos.z >> 4))*8 + (pos.y >> 4);
+		keys.push_back(section << 12 | (pos.x&15) << 8 | (pos.z&15) << 4 | (pos.y&15));
+	}
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	uint8_t pbuf[65536];
+	PacketWriter pw(pbuf);
+	pw.write8(S_SectionUpdates);
+	std::bitset<4096> dirty;
+	std::vector<uint8_t> entries;
+	for (size_t i = 0; i < keys.size(); ) {
+		uint64_t section = keys[i] >> 12;
+		size_t end = i;
+		while (end < keys.size() && keys[end] >> 12 == section)
+			end++;
+		int bx = section / 8 / zsections * 16, bz = section / 8 % zsections * 16, by = section % 8 * 16;
+		auto get = [&](int o) {
+			int x = bx + (o >> 8), y = by + (o & 15), z = bz + (o >> 4 & 15);
+			return (uint16_t)(level.get_tile_id(x, y, z) << 4 | level.get_tile_meta(x, y, z));
+		};
+		dirty.reset();
+		for (size_t j = i; j < end; j++)
+			dirty.set(keys[j] & 4095);
+		entries.clear();
+		size_t count = 0;
+		for (size_t j = i; j < end; j++) {
+			int o = keys[j] & 4095;
+			if (!dirty[o])
+				continue;
+			uint16_t v = get(o);
+			// the longest run of dirty blocks with the same id from here
+			// up y, z or x
+			static const int strides[3] = {1, 16, 256};
+			int kind = SECTION_BLOCK, len = 1;
+			for (int a = 0; a < 3; a++) {
+				int n = 1, left = 15 - (o / strides[a] & 15);
+				while (n <= left && dirty[o + n*strides[a]] && get(o + n*strides[a]) >> 4 == v >> 4)
+					n++;
+				if (n > len) {
+					len = n;
+					kind = SECTION_RUN_Y + a;
+				}
+			}
+			entries.push_back(o >> 4);
+			entries.push_back(o << 4 | kind);
+			count++;
+			if (kind == SECTION_BLOCK) {
+				entries.push_back(v >> 8);
+				entries.push_back(v);
+				continue;
+			}
+			int stride = strides[kind - SECTION_RUN_Y];
+			entries.push_back(len);
+			entries.push_back(v >> 4);
+			for (int k = 0; k < len; k += 2) {
+				uint8_t data = (get(o + k*stride) & 15) << 4;
+				if (k + 1 < len)
+					data |= get(o + (k+1)*stride) & 15;
+				entries.push_back(data);
+			}
+			for (int k = 0; k < len; k++)
+				dirty.reset(o + k*stride);
+		}
+		// a section's entries take at most 4096*4 bytes, so always fit
+		if (pw.pos + 10 + entries.size() > 65536) {
+			append(out, pw);
+			pw = PacketWriter(pbuf);
+			pw.write8(S_SectionUpdates);
+		}
+		pw.write_varint(section);
+		pw.write_varint(count);
+		pw.write_str((const char *)entries.data(), entries.size());
+		i = end;
+	}
+	if (pw.pos > 3)
+		append(out, pw);
+}
+// what changed in cell c since p last saw it
+void write_missed(Level &level, Player &p, int c) {
+	static std::vector<uint32_t> missed;
+	auto it = p.left.find(c);
+	long since = it == p.left.end() ? p.since : it->second;
+	missed.clear();
+	for (auto &ch : cells[c].changed)
+		if (ch.second >= since)
+			missed.push_back(ch.first);
+	if (p.section_updates)
+		write_section_updates(level, p.pending_blocks, missed);
+	else
+		write_blocks(level, p.pending_blocks, missed);
+}
+// moves p into cell to, -1 to take it out of the world
+void move_player(Level &level, Player &p, int to) {
+	int from = p.cell;
+	for_view(from, [&](int c) {
+		if (in_view(to, c))
+			return;
+		Cell &cell = cells[c];
+		cell.watchers.erase(std::find(cell.watchers.begin(), cell.watchers.end(), &p));
+		if (!p.congested)
+			p.left[c] = level.tick;
+		for (Player *o : cell.occupants) {
+			if (o == &p)
+				continue;
+			write_leave(p.pending, o->eid);
+			write_leave(o->pending, p.eid);
+		}
+	});
+	for_view(to, [&](int c) {
+		if (in_view(from, c))
+			return;
+		Cell &cell = cells[c];
+		cell.watchers.push_back(&p);
+		for (Player *o : cell.occupants) {
+			if (!p.congested)
+				write_enter(p.pending, *o, p.deltas);
+			write_enter(o->pending, p, o->deltas);
+		}
+		if (!p.congested)
+			write_missed(level, p, c);
+	});
+	if (from != -1) {
+		auto &occupants = cells[from].occupants;
+		occupants.erase(std::find(occupants.begin(), occupants.end(), &p));
+	}
+	if (to != -1)
+		cells[to].occupants.push_back(&p);
+	p.cell = to;
+}
+// everyone in p's view enters anew, where they are now, along with the
+// blocks that changed
+void resync_player(Level &level, Player &p) {
+	for_view(p.cell, [&](int c) {
+		for (Player *o : cells[c].occupants) {
+			write_leave(p.pending, o->eid);
+			write_enter(p.pending, *o, p.deltas);
+		}
+		write_missed(level, p, c);
+	});
+	p.resync = false;
+}
+void flush_pending(Player &p, std::vector<uint8_t> &pending, Channel channel) {
+	if (pending.empty())
+		return;
+	size_t size = pending.size();
+	p.io->messages.push({ServerMessage::SEND, p.eid,
+		std::make_shared<const std::vector<uint8_t>>(std::move(pending)), channel});
+	pending.clear();
+	pending.reserve(size);
+}
+void flush_pending(Player &p) {
+	flush_pending(p, p.pending, CH_ENTITY);
+	flush_pending(p, p.pending_blocks, CH_BLOCKS);
+}
+/* Joining. The world is deflated from a snapshot by world_threads
+ * threads of its own, so the simulation goes on meanwhile. They each
+ * take the next world frame (see world_frames) to deflate, and finished
+ * frames are passed on in order. Joiners get the frames as they come
+ * out, then the block updates made since the snapshot, and only then
+ * become players. Whoever joins while a world is being deflated shares
+ * it, getting the frames done so far straight away.
+ * RSGAME_NETPROTO_STREAM joiners get the same deflated data without the
+ * frame lengths, between a zlib header and a trailer made from the
+ * frames' checksums, which is one zlib stream.
+ * Joiners with FEATURE_WORLD_SECTIONS get frames of encoded sections,
+ * which are made by a world send of their own.
+ */
+// all cores by default, see --world-threads
+int world_threads = std::max(1, (int)std::thread::hardware_concurrency());
+struct WorldFrame {
+	// the frame's 32-bit length, then its deflated data
+	SharedBuffer length, data;
+	// the same in S_WorldData packets
+	std::vector<SharedBuffer> packets;
+	uLong adler;
+	size_t flat_len;
+};
+struct WorldSend {
+	struct Joiner {
+		int eid;
+		IoThread *io;
+		bool stream;
+		uint32_t features;
+	};
+	bool sections;
+	std::shared_ptr<const Level::Snapshot> snap;
+	std::vector<std::thread> threads;
+	std::vector<WorldFrame> frames;
+	// set by the thread that deflated the frame once it's done
+	std::unique_ptr<std::atomic<bool>[]> done;
+	std::atomic<int> next{0};
+	std::atomic<bool> failed{false};
+	std::atomic<bool> cancel{false};
+	// frames passed on so far, and the zlib stream they make up
+	size_t sent = 0;
+	uLong adler = adler32(0, nullptr, 0);
+	size_t stream_size = 2;
+	// S_BlockUpdates since the snapshot
+	std::vector<uint8_t> updates;
+	std::vector<Joiner> joiners;
+};
+// flat frames and section frames
+std::unique_ptr<WorldSend> world_sends[2];
+bool deflate_frame(std::vector<uint8_t> &in, std::vector<uint8_t> &scratch, WorldFrame &frame) {
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	// room for all of it, so a single call does it
+	scratch.resize(deflateBound(&strm, in.size()) + 16);
+	strm.next_in = in.data();
+	strm.avail_in = in.size();
+	strm.next_out = scratch.data();
+	strm.avail_out = scratch.size();
+	frame.adler = adler32(adler32(0, nullptr, 0), in.data(), in.size());
+	frame.flat_len = in.size();
+	if (deflate(&strm, Z_SYNC_FLUSH) != Z_OK || strm.avail_in || !strm.avail_out) {
+		fprintf(stderr, "zlib failed: %s\n", strm.msg ? strm.msg : "out of space");
+		deflateEnd(&strm);
+		return false;
+	}
+	size_t size = strm.next_out - scratch.data();
+	deflateEnd(&strm);
+	frame.data = std::make_shared<const std::vector<uint8_t>>(scratch.begin(), scratch.begin() + size);
+	uint8_t length[4] = {(uint8_t)(size>>24), (uint8_t)(size>>16), (uint8_t)(size>>8), (uint8_t)size};
+	frame.length = std::make_shared<const std::vector<uint8_t>>(length, length + 4);
+	frame.packets.clear();
+	std::vector<uint8_t> packet;
+	for (size_t pos = 0; pos < 4 + size; pos += world_data_max) {
+		size_t n = std::min((size_t)world_data_max, 4 + size - pos);
+		packet.assign({(uint8_t)((n+1)>>8), (uint8_t)(n+1), S_WorldData});
+		for (size_t i = pos; i < pos + n; i++)
+			packet.push_back(i < 4 ? length[i] : scratch[i-4]);
+		frame.packets.push_back(std::make_shared<const std::vector<uint8_t>>(packet));
+	}
+	return true;
+}
+void deflate_world(WorldSend *ws) {
+	const Level::Snapshot &snap = *ws->snap;
+	std::vector<uint8_t> in, scratch;
+	int count = ws->frames.size();
+	while (!ws->cancel && !ws->failed) {
+		int i = ws->next++;
+		if (i >= count)
+			return;
+		in.clear();
+		if (ws->sections) {
+			size_t n = world_frame_sections(snap.zsize);
+			snap.encode_sections(i*n, n, in);
+		} else {
+			size_t pos, len;
+			world_frame_range(i, snap.xsize, snap.zsize, pos, len);
+			in.resize(len);
+			snap.read_flat(pos, in.data(), len);
+		}
+		if (!deflate_frame(in, scratch, ws->frames[i])) {
+			ws->failed = true;
+			return;
+		}
+		ws->done[i].store(true, std::memory_order_release);
+	}
+}
+void start_world_send(Level &level, bool sections) {
+	world_sends[sections].reset(new WorldSend);
+	WorldSend &ws = *world_sends[sections];
+	ws.sections = sections;
+	ws.snap = level.snapshot();
+	int count = sections ? world_section_frames(level.xsize) : world_frames(level.xsize);
+	ws.frames.resize(count);
+	ws.done.reset(new std::atomic<bool>[count]);
+	for (int i = 0; i < count; i++)
+		ws.done[i] = false;
+	for (int i = 0; i < std::min(world_threads, count); i++)
+		ws.threads.emplace_back(deflate_world, &ws);
+}
+void send_frame(const WorldSend::Joiner &j, const WorldFrame &frame) {
+	if (j.features & FEATURE_WORLD_PACKETS) {
+		for (auto &packet : frame.packets)
+			j.io->messages.push({ServerMessage::SEND, j.eid, packet, CH_BULK});
+		return;
+	}
+	if (!j.stream)
+		j.io->messages.push({ServerMessage::SEND, j.eid, frame.length, CH_BULK});
+	j.io->messages.push({ServerMessage::SEND, j.eid, frame.data, CH_BULK});
+}
+void stop_world_sends() {
+	for (auto &ws : world_sends) {
+		if (ws) {
+			ws->cancel = true;
+			for (auto &t : ws->threads)
+				t.join();
+			ws.reset();
+		}
+	}
+}
+void add_player(Level &level, const WorldSend::Joiner &j) {
+	player_index[j.eid] = players.size();
+	players.emplace_back(new Player);
+	Player &p = *players.back();
+	p.eid = j.eid;
+	p.io = j.io;
+	p.deltas = j.features & FEATURE_ENTITY_DELTAS;
+	p.section_updates = j.features & FEATURE_SECTION_UPDATES;
+	// it has seen everything up to now in the world it got
+	p.since = level.tick + 1;
+	write_enter(p.pending, p, p.deltas);
+	move_player(level, p, cell_of(p));
+	flush_pending(p, p.pending_blocks, CH_BLOCKS);
+	j.io->messages.push({ServerMessage::LOGIN, j.eid,
+		std::make_shared<const std::vector<uint8_t>>(std::move(p.pending)), CH_ENTITY});
+	p.pending.clear();
+}
+// passes on what the world threads have done, false if deflating failed
+bool poll_world_send(Level &level, std::unique_ptr<WorldSend> &world_send) {
+	if (!world_send)
+		return true;
+	WorldSend &ws = *world_send;
+	while (ws.sent < ws.frames.size() && ws.done[ws.sent].load(std::memory_order_acquire)) {
+		WorldFrame &frame = ws.frames[ws.sent++];
+		for (auto &j : ws.joiners)
+			send_frame(j, frame);
+		ws.adler = adler32_combine(ws.adler, frame.adler, frame.flat_len);
+		ws.stream_size += frame.data->size();
+	}
+	if (ws.sent < ws.frames.size() && !ws.failed)
+		return true;
+	for (auto &t : ws.threads)
+		t.join();
+	if (ws.failed)
+		return false;
+	// a final empty fixed block, the checksum, and zeros up to a whole
+	// kilobyte, which clients take as empty packets
+	std::vector<uint8_t> trailer = {0x03, 0x00,
+		(uint8_t)(ws.adler>>24), (uint8_t)(ws.adler>>16), (uint8_t)(ws.adler>>8), (uint8_t)ws.adler};
+	trailer.resize(trailer.size() + (1024 - (ws.stream_size + trailer.size()) % 1024) % 1024);
+	SharedBuffer stream_trailer = std::make_shared<const std::vector<uint8_t>>(std::move(trailer));
+	SharedBuffer updates = std::make_shared<const std::vector<uint8_t>>(std::move(ws.updates));
+	for (auto &j : ws.joiners) {
+		if (j.stream)
+			j.io->messages.push({ServerMessage::SEND, j.eid, stream_trailer, CH_BULK});
+		j.io->messages.push({ServerMessage::SEND, j.eid, updates, CH_BLOCKS});
+		add_player(level, j);
+	}
+	world_send.reset();
+	return true;
+}
+/* Edits. C_ChangeBlock is queued on its player and applied just before
+ * a tick, up to edits_per_tick of each player's, starting from a
+ * different player every tick so none always goes first. An edit is
+ * checked against the blocks as the ones before it in the batch left
+ * them, and set straight away. Only once the whole batch is in do the
+ * neighbour updates run, once for each block however many times it was
+ * edited. Edits that don't match what's there are rejected, and so are
+ * those that come while a player already has a second's worth waiting.
+ */
+int edits_per_tick = 32;
+size_t edit_queue_limit() {
+	return (size_t)edits_per_tick * 20;
+}
+size_t next_editor = 0;
+// since the last print
+struct EditStats {
+	uint64_t applied = 0, rejected = 0, dropped = 0;
+	void print() {
+		if (!applied && !rejected && !dropped)
+			return;
+		fprintf(stderr, "Block edits: %llu applied, %llu rejected, %llu dropped\n",
+			(unsigned long long)applied, (unsigned long long)rejected, (unsigned long long)dropped);
+		*this = EditStats();
+	}
+} edit_stats;
+void apply_edits(Level &level) {
+	static std::vector<Level::BlockEdit> batch;
+	// pos_to_index to where it is in batch
+	static FlatMap edited;
+	batch.clear();
+	edited.clear();
+	size_t n = players.size();
+	for (size_t i = 0; i < n; i++) {
+		Player &p = *players[(next_editor + i) % n];
+		size_t count = std::min(p.edits.size(), (size_t)edits_per_tick);
+		for (size_t j = 0; j < count; j++) {
+			const ClientEvent &ev = p.edits[j];
+			if (!level.is_block(ev.index, ev.old_id, ev.old_data)) {
+				edit_stats.rejected++;
+				continue;
+			}
+			ivec3 pos = level.index_to_pos(ev.index);
+			level.set_tile(pos.x, pos.y, pos.z, ev.new_id, ev.new_data);
+			edit_stats.applied++;
+			if (uint32_t *at = edited.find(ev.index)) {
+				batch[*at].new_id = ev.new_id;
+			} else {
+				edited.insert(ev.index, batch.size());
+				batch.push_back({ev.index, ev.old_id, ev.new_id});
+			}
+		}
+		p.edits.erase(p.edits.begin(), p.edits.begin() + count);
+	}
+	next_editor = n ? (next_editor + 1) % n : 0;
+	if (!batch.empty())
+		level.on_blocks_edited(batch);
+}
+void handle_event(Level &level, IoThread *io, const ClientEvent &ev) {
+	uint8_t pbuf[2+25];
+	if (ev.type == ClientEvent::JOIN) {
+		std::vector<uint8_t> out;
+		PacketWriter pw(pbuf);
+		pw.write8(S_ServerIntroduction)
+			.write32(ev.proto)
+			.write32(ev.eid)
+			.write32(level.xsize)
+			.write32(level.zsize)
+			.write32(level.zbits);
+		uint32_t features = 0;
+		if (ev.features != (uint32_t)-1)
+			pw.write32(features = ev.features);
+		append(out, pw);
+		WorldSend::Joiner j = {ev.eid, io, ev.proto == RSGAME_NETPROTO_STREAM, features};
+		if (j.stream) {
+			// zlib header for deflate with a 32K window
+			out.push_back(0x78);
+			out.push_back(0x9c);
+		}
+		io->messages.push({ServerMessage::SEND, ev.eid,
+			std::make_shared<const std::vector<uint8_t>>(std::move(out)), CH_BULK});
+		bool sections = features & FEATURE_WORLD_SECTIONS;
+		if (!world_sends[sections])
+			start_world_send(level, sections);
+		WorldSend &ws = *world_sends[sections];
+		for (size_t i = 0; i < ws.sent; i++)
+			send_frame(j, ws.frames[i]);
+		ws.joiners.push_back(j);
+		return;
+	}
+	auto it = player_index.find(ev.eid);
+	if (it == player_index.end()) {
+		// left before getting the world
+		if (ev.type == ClientEvent::LEAVE) {
+			for (auto &ws : world_sends) {
+				if (!ws)
+					continue;
+				auto &joiners = ws->joiners;
+				joiners.erase(std::remove_if(joiners.begin(), joiners.end(),
+					[&](const WorldSend::Joiner &j) { return j.eid == ev.eid; }), joiners.end());
+			}
+		}
+		return;
+	}
+	Player &p = *players[it->second];
+	switch (ev.type) {
+	case ClientEvent::LEAVE: {
+		move_player(level, p, -1);
+		size_t i = it->second;
+		player_index.erase(it);
+		if (i != players.size() - 1) {
+			players[i] = std::move(players.back());
+			player_index[players[i]->eid] = i;
+		}
+		players.pop_back();
+		break;
+	}
+	case ClientEvent::POSITION:
+		p.now.x = ev.x;
+		p.now.y = ev.y;
+		p.now.z = ev.z;
+		p.now.yaw = ev.yaw;
+		p.now.pitch = ev.pitch;
+		break;
+	case ClientEvent::CONGESTED:
+		// if it hasn't caught up since the last time, it still knows
+		// what it knew then
+		if (!p.resync)
+			for_view(p.cell, [&](int c) { p.left[c] = level.tick; });
+		p.congested = true;
+		p.resync = false;
+		break;
+	case ClientEvent::DRAINED:
+		p.congested = false;
+		p.resync = true;
+		break;
+	case ClientEvent::BLOCK:
+		if (p.edits.size() < edit_queue_limit())
+			p.edits.push_back(ev);
+		else
+			edit_stats.dropped++;
+		break;
+	default:
+		break;
+	}
+}
+/* How late ticks are, from when a tick was due until its updates have
+ * been handed to the network threads, in 0.1 ms steps up to a second.
+ * Printed and started over at every checkpoint, and on exit.
+ */
+struct TickLatency {
+	uint64_t counts[10001] = {};
+	uint64_t total = 0;
+	double max_ms = 0;
+	void add(std::chrono::steady_clock::duration d) {
+		double ms = std::chrono::duration<double, std::milli>(d).count();
+		counts[std::min((size_t)(ms*10), (size_t)10000)]++;
+		total++;
+		max_ms = std::max(max_ms, ms);
+	}
+	double percentile(double p) {
+		uint64_t want = (uint64_t)ceil(total*p), n = 0;
+		for (size_t i = 0; i < 10000; i++)
+			if ((n += counts[i]) >= want)
+				return (i+1) / 10.0;
+		return max_ms;
+	}
+	void print() {
+		if (!total)
+			return;
+		fprintf(stderr, "Tick latency over %llu ticks: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+			(unsigned long long)total, percentile(0.5), percentile(0.9), percentile(0.99), max_ms);
+		memset(counts, 0, sizeof(counts));
+		total = 0;
+		max_ms = 0;
+	}
+};
+TickLatency tick_latency;
 int main(int argc, char** argv)
 {
 	time_init();
@@ -329,10 +2138,47 @@ int main(int argc, char** argv)
 
 	const char *listen_host = "127.0.0.1";
 	const char *listen_port = "21814";
-	if (argc > 1)
-		listen_host = argv[1];
-	if (argc > 2)
-		listen_port = argv[2];
+	const char *world_path = "world.rsw";
+	int sim_threads = 1;
+	bool bfs_wires = false;
+	int io_thread_count = 1;
+	int freeargs = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--world") && i+1 < argc) {
+			world_path = argv[++i];
+		} else if (!strcmp(argv[i], "--world-threads") && i+1 < argc) {
+			world_threads = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--view-distance") && i+1 < argc) {
+			view_distance = std::max(0, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--send-queue-limit") && i+1 < argc) {
+			// in KiB
+			send_queue_limit = (size_t)std::max(1, atoi(argv[++i])) * 1024;
+		} else if (!strcmp(argv[i], "--slow-client-timeout") && i+1 < argc) {
+			slow_client_timeout = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--bulk-per-tick") && i+1 < argc) {
+			// in KiB
+			bulk_per_tick = (size_t)std::max(1, atoi(argv[++i])) * 1024;
+		} else if (!strcmp(argv[i], "--packet-rate") && i+1 < argc) {
+			packet_rate = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--edits-per-tick") && i+1 < argc) {
+			edits_per_tick = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--sim-threads") && i+1 < argc) {
+			sim_threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bfs-wires")) {
+			bfs_wires = true;
+		} else if (!strcmp(argv[i], "--io-threads") && i+1 < argc) {
+			io_thread_count = std::max(1, atoi(argv[++i]));
+#ifdef RSGAME_HAVE_URING
+		} else if (!strcmp(argv[i], "--io-uring")) {
+			use_uring = true;
+#endif
+		} else {
+			switch (freeargs++) {
+				case 0: listen_host = argv[i]; break;
+				case 1: listen_port = argv[i]; break;
+			}
+		}
+	}
 
 	struct addrinfo hints, *res;
 	memset(&hints, 0, sizeof(hints));
@@ -368,7 +2214,7 @@ int main(int argc, char** argv)
 		return 1;
 	}
 	freeaddrinfo(res);
-	if (listen(listenfd, 10) == -1) {
+	if (listen(listenfd, SOMAXCONN) == -1) {
 		net_perror("listen");
 		return 1;
 	}
@@ -376,182 +2222,176 @@ int main(int argc, char** argv)
 		net_perror("net_nonblock");
 		return 1;
 	}
-	poller.listenfd = listenfd;
+	for (int i = 0; i < io_thread_count; i++)
+		io_threads.emplace_back(new IoThread);
+	for (int i = 0; i < io_thread_count; i++) {
+		IoThread *io = io_threads[i].get();
+		io->thread = std::thread(run_io_thread, io, i ? -1 : listenfd);
+		if (!io->started.get_future().get()) {
+			stop_io_threads();
+			return 1;
+		}
+	}
 	fprintf(stderr, "Listening...\n");
 
 	Level level;
+	if (FILE *f = fopen(world_path, "rb")) {
+		fclose(f);
+		uint64_t load_start = time_ticks();
+		if (!level.load(world_path))
+			return 1;
+		fprintf(stderr, "Loaded %s in %d ms\n", world_path, (int)(time_ticks() - load_start));
+		// the journals go on from what was loaded, whatever the format
+		if (level.outdated_file) {
+			fprintf(stderr, "Upgrading %s\n", world_path);
+			if (!level.save(world_path))
+				return 1;
+		}
+	} else {
+		fprintf(stderr, "Creating %s\n", world_path);
+		if (!level.save(world_path))
+			return 1;
+	}
+	init_cells(level);
+	level_xsize = level.xsize;
+	level_zsize = level.zsize;
+	Journal journal(&level, world_path);
+	if (!journal.open())
+		return 1;
 	RenderLevel rl;
 	level.rl = &rl;
+	level.set_sim_threads(sim_threads);
+	level.breadth_first_wires = bfs_wires;
+	signal(SIGINT, on_quit_signal);
+	signal(SIGTERM, on_quit_signal);
+	long last_checkpoint = level.tick;
 
-	uint64_t unprocessed_ms = 0;
-	uint32_t last_frame = time_ticks();
-	for (;;) {
-		poller.poll();
-		Connection *conn;
-		while ((conn = poller.next_to_read())) {
-			while (conn->read()) {
-				int plen = conn->readlen - 2;
-				PacketReader pr(conn->readbuf + 2);
-				if (!conn->logged_in) {
-					uint8_t pbuf[2+21];
-					if (plen != 5 || pr.read8() != C_ClientIntroduction || pr.read32() != RSGAME_NETPROTO) {
-						conn->send(PacketWriter(pbuf)
-							.write8(B_Disconnect)
-							.write_str("Bad proto", 9));
-						conn->dead = true;
-					leave:
-						break;
-					}
-					conn->send(PacketWriter(pbuf)
-						.write8(S_ServerIntroduction)
-						.write32(RSGAME_NETPROTO)
-						.write32(conn->eid)
-						.write32(level.xsize)
-						.write32(level.zsize)
-						.write32(level.zbits));
-					{
-						z_stream strm;
-						uint8_t zbuf[1024];
-						memset(&strm, 0, sizeof(strm));
-						deflateInit(&strm, Z_DEFAULT_COMPRESSION);
-						strm.next_in = level.buf.data();
-						strm.avail_in = level.buf.size();
-						int res = Z_OK;
-						while (res == Z_OK) {
-							strm.next_out = zbuf;
-							strm.avail_out = sizeof(zbuf);
-							res = deflate(&strm, Z_FINISH);
-							if (res == Z_OK) {
-								if (strm.avail_out != 0) {
-									fprintf(stderr, "zlib doesn't work the way I want it to work\n");
-									return 1;
-								}
-							} else if (res == Z_STREAM_END) {
-								memset(strm.next_out, 0, strm.avail_out);
-							} else {
-								fprintf(stderr, "zlib failed: %s\n", strm.msg);
-								return 1;
-							}
-							conn->write(zbuf, sizeof(zbuf));
-						}
-						deflateEnd(&strm);
-					}
-					{
-						PacketWriter pw(pbuf);
-						pw.write8(S_EntityEnter);
-						pw.write32(conn->eid);
-						for (Connection *conn : conns)
-							if (conn->logged_in)
-								conn->send(pw);
-					}
-					conn->logged_in = true;
-					for (Connection *conn2 : conns)
-						if (conn2->logged_in) {
-							conn->send(PacketWriter(pbuf)
-								.write8(S_EntityEnter)
-								.write32(conn2->eid));
-						}
-					new_joins_this_tick = true;
-				} else {
-					if (plen == 0)
-						continue;
-					switch (pr.read8()) {
-					case B_Disconnect: {
-						fprintf(stderr, "Disconnected: %.*s\n", plen-1, &conn->readbuf[3]);
-						conn->dead = true;
-						goto leave;
-					}
-					case C_ChangePosition: {
-						if (plen < 17)
-							break;
-						conn->x = pr.read32();
-						conn->y = pr.read32();
-						conn->z = pr.read32();
-						conn->yaw = pr.read16();
-						conn->pitch = pr.read16();
-						break;
-					}
-					case C_ChangeBlock: {
-						if (plen < 8)
-							break;
-						uint32_t index = pr.read32();
-						uint8_t old_id = pr.read8();
-						uint8_t old_data = pr.read8();
-						uint8_t new_id = pr.read8();
-						uint8_t new_data = pr.read8();
-
-						ivec3 pos = level.index_to_pos(index);
-						if (old_id == level.get_tile_id(pos.x, pos.y, pos.z) &&
-								old_data == level.get_tile_meta(pos.x, pos.y, pos.z)) {
-							level.set_tile(pos.x, pos.y, pos.z, new_id, new_data);
-							if (new_id != 0)
-								level.on_block_add(pos.x, pos.y, pos.z, new_id);
-							else
-								level.on_block_remove(pos.x, pos.y, pos.z, old_id);
-						}
-						break;
-					}
-					}
-				}
-			}
+	using clock = std::chrono::steady_clock;
+	clock::time_point next_tick = clock::now() + tick_length;
+	while (!quit_requested) {
+		for (auto &io : io_threads) {
+			ClientEvent ev;
+			while (io->events.pop(ev))
+				handle_event(level, io.get(), ev);
+		}
+		if (!poll_world_send(level, world_sends[0]) || !poll_world_send(level, world_sends[1])) {
+			stop_io_threads();
+			return 1;
 		}
-		uint64_t current_frame = time_ticks();
-		unprocessed_ms += current_frame - last_frame;
-		last_frame = current_frame;
-		if (unprocessed_ms > 50) {
-			while (unprocessed_ms > 50) {
+		clock::time_point now = clock::now();
+		if (now >= next_tick) {
+			clock::time_point due = next_tick;
+			while (now >= next_tick) {
+				apply_edits(level);
 				level.on_tick();
-				unprocessed_ms -= 50;
+				next_tick += tick_length;
 			}
-			uint8_t pbuf[65536];
-			for (auto it = block_updates.begin(); it != block_updates.end(); ) {
-				PacketWriter pw(pbuf);
-				pw.write8(S_BlockUpdates);
-				while (pw.pos < 65536 - 6 && it != block_updates.end()) {
-					ivec3 pos = *it++;
-					pw.write32(level.pos_to_index(pos.x, pos.y, pos.z));
-					pw.write8(level.get_tile_id(pos.x, pos.y, pos.z));
-					pw.write8(level.get_tile_meta(pos.x, pos.y, pos.z));
-				}
-				for (Connection *conn : conns)
-					if (conn->logged_in)
-						conn->send(pw);
+			journal.end_tick();
+			if (level.tick - last_checkpoint >= checkpoint_ticks) {
+				journal.checkpoint();
+				last_checkpoint = level.tick;
+				tick_latency.print();
+				edit_stats.print();
+			}
+			for (auto &p : players) {
+				int c = cell_of(*p);
+				if (c != p->cell)
+					move_player(level, *p, c);
+				if (p->resync)
+					resync_player(level, *p);
+			}
+			for (ivec3 pos : block_updates) {
+				uint32_t index = level.pos_to_index(pos.x, pos.y, pos.z);
+				if (index == (uint32_t)-1)
+					continue;
+				Cell &cell = cells[cell_at(pos.x, pos.z)];
+				if (cell.blocks.empty() && cell.movers.empty())
+					dirty_cells.push_back(&cell - cells.data());
+				cell.blocks.push_back(index);
 			}
 			block_updates.clear();
-			for (auto it = conns.begin(); it != conns.end(); ) {
-				PacketWriter pw(pbuf);
-				pw.write8(S_EntityUpdates);
-				while (pw.pos < 65536 - 20 && it != conns.end()) {
-					Connection *conn = *it++;
-					if (!new_joins_this_tick &&
-							conn->x == conn->oldx &&
-							conn->y == conn->oldy &&
-							conn->z == conn->oldz &&
-							conn->yaw == conn->oldyaw &&
-							conn->pitch == conn->oldpitch)
+			dirty_sections.clear();
+			for (auto &p : players) {
+				if (p->now == p->sent)
+					continue;
+				Cell &cell = cells[p->cell];
+				if (cell.blocks.empty() && cell.movers.empty())
+					dirty_cells.push_back(p->cell);
+				cell.movers.push_back(p.get());
+			}
+			// sends out, one encoding of a cell's updates, to the watchers
+			// that get it
+			auto deliver = [&](Cell &cell, const std::vector<uint8_t> &out, Channel channel, auto gets) {
+				if (out.empty())
+					return;
+				if (out.size() < share_size) {
+					for (Player *p : cell.watchers) {
+						if (p->congested || !gets(*p))
+							continue;
+						auto &pending = channel == CH_BLOCKS ? p->pending_blocks : p->pending;
+						pending.insert(pending.end(), out.begin(), out.end());
+					}
+					return;
+				}
+				SharedBuffer buf = std::make_shared<const std::vector<uint8_t>>(out);
+				for (Player *p : cell.watchers) {
+					if (p->congested || !gets(*p))
 						continue;
-					pw.write32(conn->eid);
-					pw.write32(conn->x);
-					pw.write32(conn->y);
-					pw.write32(conn->z);
-					pw.write16(conn->yaw);
-					pw.write16(conn->pitch);
-					conn->oldx = conn->x;
-					conn->oldy = conn->y;
-					conn->oldz = conn->z;
-					conn->oldyaw = conn->yaw;
-					conn->oldpitch = conn->pitch;
+					flush_pending(*p);
+					p->io->messages.push({ServerMessage::SEND, p->eid, buf, channel});
+				}
+			};
+			std::vector<uint8_t> blocks[2], moves[2];
+			for (int c : dirty_cells) {
+				Cell &cell = cells[c];
+				blocks[0].clear();
+				blocks[1].clear();
+				write_blocks(level, blocks[0], cell.blocks);
+				// joiners get S_BlockUpdates whatever they asked for
+				for (auto &ws : world_sends)
+					if (ws)
+						ws->updates.insert(ws->updates.end(), blocks[0].begin(), blocks[0].end());
+				for (uint32_t index : cell.blocks)
+					cell.changed[index] = level.tick;
+				// a version for each encoding someone gets
+				bool section_updates[2] = {}, deltas[2] = {};
+				for (Player *p : cell.watchers) {
+					if (!p->congested) {
+						section_updates[p->section_updates] = true;
+						deltas[p->deltas] = true;
+					}
+				}
+				if (section_updates[1])
+					write_section_updates(level, blocks[1], cell.blocks);
+				for (int e = 0; e < 2; e++) {
+					moves[e].clear();
+					if (deltas[e])
+						write_moves(moves[e], cell.movers, e);
 				}
-				for (Connection *conn : conns)
-					if (conn->logged_in)
-						conn->send(pw);
+				for (int e = 0; e < 2; e++) {
+					if (section_updates[e])
+						deliver(cell, blocks[e], CH_BLOCKS, [&](const Player &p) { return p.section_updates == e; });
+					if (deltas[e])
+						deliver(cell, moves[e], CH_ENTITY, [&](const Player &p) { return p.deltas == e; });
+				}
+				cell.blocks.clear();
+				cell.movers.clear();
+			}
+			dirty_cells.clear();
+			for (auto &p : players) {
+				p->sent = p->now;
+				flush_pending(*p);
 			}
+			tick_latency.add(clock::now() - due);
 		}
-		new_joins_this_tick = false;
-		poller.process_writes();
-		accept_connections();
-		close_dead_connections();
+		std::this_thread::sleep_until(std::min(next_tick, clock::now() + std::chrono::milliseconds(1)));
 	}
+	stop_world_sends();
+	stop_io_threads();
+	tick_latency.print();
+	edit_stats.print();
+	fprintf(stderr, "Saving %s\n", world_path);
+	journal.close();
 	return 0;
 }
 }
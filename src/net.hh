@@ -6,12 +6,18 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
 #include <stdio.h>
+#include <limits.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 namespace rsgame {
 	inline int net_close(int fd) {
 		return close(fd);
@@ -22,6 +28,20 @@ namespace rsgame {
 	inline int net_write(int fd, const void *buf, size_t len) {
 		return write(fd, buf, len);
 	}
+	typedef struct iovec net_iovec;
+	// the most buffers net_writev takes at once
+	const int net_iov_max = IOV_MAX;
+	inline void net_iovec_set(net_iovec &iov, const void *buf, size_t len) {
+		iov.iov_base = (void *)buf;
+		iov.iov_len = len;
+	}
+	inline int net_writev(int fd, net_iovec *iov, int count) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		return sendmsg(fd, &msg, MSG_NOSIGNAL);
+	}
 	inline int net_setsockopt(int fd, int level, int optname, const void *optval, int optlen) {
 		return setsockopt(fd, level, optname, optval, optlen);
 	}
@@ -43,6 +63,13 @@ namespace rsgame {
 	inline bool net_again() {
 		return errno == EAGAIN;
 	}
+	// for a non-blocking socket's writes that ran into a full buffer
+	inline int net_wait_writable(int sock) {
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLOUT;
+		return poll(&pfd, 1, -1);
+	}
 	inline void net_perror(const char *s) {
 		perror(s);
 	}
@@ -74,6 +101,18 @@ namespace rsgame {
 	inline int net_write(int fd, const void *buf, size_t len) {
 		return send(fd, (const char *)buf, len, 0);
 	}
+	typedef WSABUF net_iovec;
+	const int net_iov_max = 64;
+	inline void net_iovec_set(net_iovec &iov, const void *buf, size_t len) {
+		iov.buf = (CHAR *)buf;
+		iov.len = len;
+	}
+	inline int net_writev(int fd, net_iovec *iov, int count) {
+		DWORD sent;
+		if (WSASend(fd, iov, count, &sent, 0, NULL, NULL))
+			return -1;
+		return sent;
+	}
 	inline int net_setsockopt(int fd, int level, int optname, const void *optval, int optlen) {
 		return setsockopt(fd, level, optname, (const char *)optval, optlen);
 	}
@@ -92,6 +131,12 @@ namespace rsgame {
 	inline bool net_again() {
 		return WSAGetLastError() == WSAEWOULDBLOCK;
 	}
+	inline int net_wait_writable(int sock) {
+		fd_set writefds;
+		writefds.fd_count = 1;
+		writefds.fd_array[0] = sock;
+		return select(0, NULL, &writefds, NULL, NULL);
+	}
 	inline void net_perror(const char *s) {
 		char buf[256];
 		int error = WSAGetLastError();
@@ -105,7 +150,9 @@ namespace rsgame {
 }
 #endif
 // rsgame specific helpers
-#define RSGAME_NETPROTO 0x20231227
+#define RSGAME_NETPROTO 0x20261017
+// older clients, which get the world as one zlib stream
+#define RSGAME_NETPROTO_STREAM 0x20231227
 namespace rsgame {
 	enum {
 		C_ClientIntroduction = 0,
@@ -117,6 +164,9 @@ namespace rsgame {
 		S_EntityEnter,
 		S_EntityLeave,
 		S_EntityUpdates,
+		S_EntityDeltas,
+		S_SectionUpdates,
+		S_WorldData,
 	};
 	struct PacketReader {
 		uint8_t *buf;
@@ -136,6 +186,23 @@ namespace rsgame {
 			buf += 4;
 			return x;
 		}
+		// 7 bits at a time, lowest first, the top bit set on all but
+		// the last byte
+		uint32_t read_varint() {
+			uint32_t x = 0;
+			for (int shift = 0; shift < 35; shift += 7) {
+				uint8_t b = read8();
+				x |= (uint32_t)(b & 127) << shift;
+				if (!(b & 128))
+					break;
+			}
+			return x;
+		}
+		// zigzag encoded, so small negative numbers are short too
+		int32_t read_svarint() {
+			uint32_t x = read_varint();
+			return (int32_t)(x >> 1 ^ -(x & 1));
+		}
 	};
 	struct PacketWriter {
 		uint8_t *buf;
@@ -157,18 +224,208 @@ namespace rsgame {
 			buf[pos++] = x;
 			return *this;
 		}
+		PacketWriter &write_varint(uint32_t x) {
+			while (x >= 128) {
+				buf[pos++] = x | 128;
+				x >>= 7;
+			}
+			buf[pos++] = x;
+			return *this;
+		}
+		PacketWriter &write_svarint(int32_t x) {
+			return write_varint((uint32_t)x << 1 ^ (uint32_t)(x >> 31));
+		}
 		PacketWriter &write_str(const char *p, int len) {
 			memcpy(buf+pos, p, len);
 			pos += len;
 			return *this;
 		}
-		void send(int sock) {
-			buf[0] = (pos-2)>>16;
+		// fills in the length, and returns the size of the whole packet
+		int finish() const {
+			buf[0] = (pos-2)>>8;
 			buf[1] = (pos-2);
-			if (net_write(sock, buf, pos) != pos) {
-				net_perror("net_write");
+			return pos;
+		}
+		// the socket may be non-blocking, the packet still goes out
+		// whole
+		void send(int sock) {
+			int done = 0, len = finish();
+			while (done < len) {
+				int r = net_write(sock, buf + done, len - done);
+				if (r == -1 && net_again() && net_wait_writable(sock) != -1)
+					continue;
+				if (r <= 0) {
+					net_perror("net_write");
+					return;
+				}
+				done += r;
 			}
 		}
 	};
+	/* Takes whole packets off a non-blocking socket. Each read asks for
+	 * as much as there is room for in buf, and the packets in it are
+	 * handed out in place, length prefix and all. When there's no room
+	 * at the end, the unfinished packet left is moved to the front,
+	 * and buf only grows when that packet wouldn't fit even then. A
+	 * read that comes back short means the socket had nothing more,
+	 * which is as good as EAGAIN, so a burst of packets usually costs a
+	 * single read.
+	 * A packet is only valid until the next call. */
+	struct FrameReader {
+		std::vector<uint8_t> buf = std::vector<uint8_t>(16384);
+		size_t start = 0, end = 0;
+		// what the last net_read returned, after read() gave up this
+		// is 0 if the socket was closed and -1 if it failed (or has
+		// nothing, see net_again)
+		int last = 1;
+		bool drained = false;
+		// the next buffered packet
+		uint8_t *next(int &len) {
+			if (end - start < 2)
+				return nullptr;
+			len = 2 + (buf[start] << 8 | buf[start+1]);
+			if (end - start < (size_t)len)
+				return nullptr;
+			uint8_t *p = &buf[start];
+			start += len;
+			return p;
+		}
+		// room for at least len bytes at end
+		uint8_t *space(size_t len) {
+			if (start == end) {
+				start = end = 0;
+			} else if (buf.size() - end < len && start) {
+				memmove(&buf[0], &buf[start], end - start);
+				end -= start;
+				start = 0;
+			}
+			if (buf.size() - end < len)
+				buf.resize(std::max(buf.size() * 2, end + len));
+			return &buf[end];
+		}
+		size_t buffered() const {
+			return end - start;
+		}
+		// for data that was received some other way
+		void append(const uint8_t *data, size_t len) {
+			memcpy(space(len), data, len);
+			end += len;
+		}
+		int fill(int sock) {
+			// enough for the unfinished packet, if it's known how big
+			// it is
+			size_t want = 4096;
+			if (end - start >= 2)
+				want = std::max(want, 2 + (buf[start] << 8 | buf[start+1]) - (end - start));
+			space(want);
+			size_t room = buf.size() - end;
+			last = net_read(sock, &buf[end], room);
+			if (last > 0) {
+				end += last;
+				drained = (size_t)last < room;
+			}
+			return last;
+		}
+		// the next packet, reading from sock if need be. Null once the
+		// socket has nothing more for now, or when the read failed,
+		// see last
+		uint8_t *read(int sock, int &len) {
+			for (;;) {
+				if (uint8_t *p = next(len))
+					return p;
+				if (drained) {
+					drained = false;
+					return nullptr;
+				}
+				if (fill(sock) <= 0)
+					return nullptr;
+			}
+		}
+	};
+	/* C_ClientIntroduction can end with a 32-bit set of features the
+	 * client would like, and S_ServerIntroduction then ends with the
+	 * ones it's getting. */
+	enum {
+		// world frames hold sections in the codec of Section::encode,
+		// see world_section_frames
+		FEATURE_WORLD_SECTIONS = 1,
+		// S_EntityDeltas instead of S_EntityUpdates
+		FEATURE_ENTITY_DELTAS = 2,
+		// S_SectionUpdates instead of S_BlockUpdates, except right
+		// after the world
+		FEATURE_SECTION_UPDATES = 4,
+		// the world comes in S_WorldData packets, see world_data_max
+		FEATURE_WORLD_PACKETS = 8,
+	};
+	/* An S_EntityDeltas record is the entity id as a varint, a byte of
+	 * which fields follow, and those fields: how far the entity moved
+	 * since its last record as svarints, and its angles quantized to a
+	 * byte each. A new entity starts out all zeros, and its first record
+	 * after S_EntityEnter has everything that isn't. */
+	enum {
+		DELTA_X = 1,
+		DELTA_Y = 2,
+		DELTA_Z = 4,
+		DELTA_YAW = 8,
+		DELTA_PITCH = 16,
+	};
+	// the most an S_EntityDeltas record takes
+	const int entity_delta_max = 5 + 1 + 3*5 + 2;
+	/* S_SectionUpdates has the changed blocks of each section as the
+	 * section's number in the order of Level::sections and a count as
+	 * varints, then that many entries. An entry is a 16-bit offset in
+	 * the section (x << 8 | z << 4 | y) << 4 | kind, and then for
+	 * SECTION_BLOCK the block as id << 4 | data in 16 bits, or for a run
+	 * of blocks with the same id along an axis, a byte count, the id,
+	 * and their data, two to a byte with the first in the high nibble.
+	 */
+	enum {
+		SECTION_BLOCK = 0,
+		SECTION_RUN_Y = 1,
+		SECTION_RUN_Z = 2,
+		SECTION_RUN_X = 3,
+	};
+	/* With RSGAME_NETPROTO the world comes after S_ServerIntroduction as
+	 * world_frames() frames, each a 32-bit length and then that much raw
+	 * deflate data, ended with a sync flush. Every frame is deflated on
+	 * its own, so frames can be inflated in any order. Frame i holds the
+	 * part of the flat world given by world_frame_range: the block ids of
+	 * world_frame_columns x columns in the first half of the frames, and
+	 * their metadata in the second half.
+	 * Put in order between a zlib header and trailer, the frames' data is
+	 * also the zlib stream that RSGAME_NETPROTO_STREAM clients get.
+	 */
+	const int world_frame_columns = 16;
+	inline int world_frames(int xsize) {
+		return (xsize + world_frame_columns - 1) / world_frame_columns * 2;
+	}
+	inline void world_frame_range(int i, int xsize, int zsize, size_t &pos, size_t &len) {
+		int groups = world_frames(xsize) / 2;
+		int g = i % groups;
+		int columns = std::min(world_frame_columns, xsize - g*world_frame_columns);
+		// x columns are zsize*128 ids and half that in metadata
+		size_t column = (size_t)zsize * 128;
+		if (i < groups) {
+			pos = g * world_frame_columns * column;
+			len = columns * column;
+		} else {
+			pos = xsize * column + g * world_frame_columns * column/2;
+			len = columns * column/2;
+		}
+	}
+	/* With FEATURE_WORLD_SECTIONS there is a frame for each 16 x columns
+	 * instead, framed and deflated the same way, holding their sections
+	 * in the order of Level::sections. */
+	inline int world_section_frames(int xsize) {
+		return (xsize + 15) / 16;
+	}
+	inline size_t world_frame_sections(int zsize) {
+		return (size_t)(zsize + 15) / 16 * 8;
+	}
+	/* With FEATURE_WORLD_PACKETS the frames, lengths and all, are cut
+	 * into S_WorldData packets of up to world_data_max bytes of them
+	 * instead, and entity packets can come in between. Block updates
+	 * still only come after the whole world. */
+	const int world_data_max = 65535 - 1;
 }
 #endif
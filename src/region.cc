@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#include "common.hh"
+#include "level.hh"
+#include "region.hh"
+#include <stdio.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#undef near
+#undef far
+#undef min
+#undef max
+#endif
+namespace rsgame {
+/* World file format
+ * All integers are little-endian.
+ *    0  char[8]  magic "RSGWORLD"
+ *    8  u32      version
+ *   12  u32      xsize
+ *   16  u32      zsize
+ *   20  u32      zbits
+ *   24  i64      tick
+ *   32  u32      size of the section records in 64 byte units
+ *   36  u32      number of scheduled updates
+ *   40  u32      first journal generation to replay, see journal.cc
+ *   64  u32[]    section index, in the same order as Level::sections
+ * The index is followed by the section records, starting at the next 4096
+ * byte boundary. An index entry is 0 for an all-air section, 0x80000000 |
+ * block for a section made of a single block, and otherwise size class << 27
+ * | (unit + 1) for a record that many units in. A record is the section in
+ * the section codec's format, see level.cc, in as many units as its size
+ * class has, see region_class_units. The classes let the journal put a
+ * changed section back where it was, or where another one of the same
+ * class used to be. Raw sections, the ones with too many different blocks
+ * to compress, are used straight from the mapping and only get paged in
+ * when something reads them. The rest are decoded when loading.
+ * Scheduled updates follow the last record, in the order they will run:
+ *    0  u32      pos_to_index
+ *    4  u8       block id
+ *    8  i64      target tick
+ * Version 1 had section slots where the records are now, each 4096 block ids
+ * followed by 2048 bytes of metadata nibbles, and slot number + 1 in the
+ * index. Those still load, and are written back in the current version.
+ */
+#ifndef WIN32
+static std::shared_ptr<const uint8_t> map_file(const char *path, size_t &size) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		close(fd);
+		return nullptr;
+	}
+	size = st.st_size;
+	void *p = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return nullptr;
+	}
+	return std::shared_ptr<const uint8_t>((const uint8_t *)p, [size](const uint8_t *p) {
+		munmap((void *)p, size);
+	});
+}
+#else
+static std::shared_ptr<const uint8_t> map_file(const char *path, size_t &size) {
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "%s: CreateFile failed (%lu)\n", path, GetLastError());
+		return nullptr;
+	}
+	LARGE_INTEGER li;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &li) && li.QuadPart)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping) {
+		fprintf(stderr, "%s: CreateFileMapping failed (%lu)\n", path, GetLastError());
+		return nullptr;
+	}
+	size = li.QuadPart;
+	void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!p) {
+		fprintf(stderr, "%s: MapViewOfFile failed (%lu)\n", path, GetLastError());
+		return nullptr;
+	}
+	return std::shared_ptr<const uint8_t>((const uint8_t *)p, [](const uint8_t *p) {
+		UnmapViewOfFile(p);
+	});
+}
+#endif
+bool Level::load(const char *path) {
+	size_t size;
+	std::shared_ptr<const uint8_t> map = map_file(path, size);
+	if (!map)
+		return false;
+	const uint8_t *p = map.get();
+	if (size < REGION_HEADER || memcmp(p, "RSGWORLD", 8)) {
+		fprintf(stderr, "%s: not a world file\n", path);
+		return false;
+	}
+	uint32_t version = get_le32(p+8);
+	if (version != REGION_VERSION && version != 1) {
+		fprintf(stderr, "%s: unsupported version %u\n", path, version);
+		return false;
+	}
+	int xs = get_le32(p+12), zs = get_le32(p+16), zb = get_le32(p+20);
+	// nunits counts slots in version 1
+	uint32_t nunits = get_le32(p+32), nsched = get_le32(p+36);
+	if (xs <= 0 || zs <= 0 || zb < 0 || zb > 24 || zs > 1 << zb || xs > 1 << (25-zb)) {
+		fprintf(stderr, "%s: bad level size\n", path);
+		return false;
+	}
+	size_t nsections = (size_t)((xs + 15) >> 4)*((zs + 15) >> 4)*8;
+	size_t data_offset = region_data_offset(nsections);
+	size_t unit = version == 1 ? REGION_SLOT : REGION_UNIT;
+	size_t sched_offset = data_offset + (size_t)nunits*unit;
+	if (size < sched_offset + (size_t)nsched*REGION_SCHED) {
+		fprintf(stderr, "%s: truncated\n", path);
+		return false;
+	}
+	xsize = xs;
+	zsize = zs;
+	zbits = zb;
+	xsections = (xsize + 15) >> 4;
+	zsections = (zsize + 15) >> 4;
+	tick = get_le64(p+24);
+	sections.assign(nsections, Section());
+	clear_wire_infos();
+	for (size_t i = 0; i < nsections; i++) {
+		uint32_t e = get_le32(p + REGION_HEADER + i*4);
+		if (e & 0x80000000) {
+			sections[i].fill(e & 0xFFFF);
+		} else if (e && version == 1) {
+			if (e > nunits) {
+				fprintf(stderr, "%s: bad slot number in section %zu\n", path, i);
+				return false;
+			}
+			sections[i].map(p + data_offset + (size_t)(e-1)*REGION_SLOT);
+		} else if (e) {
+			int c = region_entry_class(e);
+			size_t start = region_entry_unit(e);
+			if (c >= REGION_CLASSES || start + region_class_units[c] > nunits
+					|| !sections[i].decode(p + data_offset + start*REGION_UNIT, region_class_units[c]*REGION_UNIT, true)) {
+				fprintf(stderr, "%s: bad record for section %zu\n", path, i);
+				return false;
+			}
+		}
+	}
+	clear_scheduled_updates();
+	for (uint32_t i = 0; i < nsched; i++) {
+		const uint8_t *r = p + sched_offset + i*REGION_SCHED;
+		restore_scheduled_update(get_le32(r), r[4], get_le64(r+8));
+	}
+	mapping = std::move(map);
+	outdated_file = version != REGION_VERSION;
+	journal_generation = get_le32(p+40);
+	return true;
+}
+bool Level::save(const char *path) {
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f) {
+		perror(tmp_path);
+		return false;
+	}
+	size_t data_offset = region_data_offset(sections.size());
+	std::vector<uint8_t> head(data_offset), data;
+	std::vector<ScheduledUpdate> sched = get_scheduled_updates();
+	for (size_t i = 0; i < sections.size(); i++) {
+		uint16_t v;
+		uint32_t e;
+		if (!sections[i].is_uniform(v)) {
+			size_t start = data.size();
+			sections[i].encode(data);
+			int c = region_class(data.size() - start);
+			data.resize(start + region_class_units[c]*REGION_UNIT);
+			if (data.size()/REGION_UNIT > REGION_MAX_UNITS) {
+				fprintf(stderr, "%s: too much to fit in a world file\n", path);
+				fclose(f);
+				return false;
+			}
+			e = region_entry(c, start/REGION_UNIT);
+		} else if (v) {
+			e = 0x80000000 | v;
+		} else {
+			e = 0;
+		}
+		put_le32(&head[REGION_HEADER + i*4], e);
+	}
+	memcpy(&head[0], "RSGWORLD", 8);
+	put_le32(&head[8], REGION_VERSION);
+	put_le32(&head[12], xsize);
+	put_le32(&head[16], zsize);
+	put_le32(&head[20], zbits);
+	put_le64(&head[24], tick);
+	put_le32(&head[32], data.size()/REGION_UNIT);
+	put_le32(&head[36], sched.size());
+	put_le32(&head[40], journal_generation);
+	fwrite(head.data(), 1, head.size(), f);
+	fwrite(data.data(), 1, data.size(), f);
+	for (auto &u : sched) {
+		uint8_t r[REGION_SCHED];
+		put_sched(r, u.index, u.id, u.target_tick);
+		fwrite(r, 1, sizeof(r), f);
+	}
+	// on disk before the rename, or a crash could leave the world file
+	// renamed but not all there
+#ifndef WIN32
+	bool synced = !fflush(f) && !fsync(fileno(f));
+#else
+	bool synced = !fflush(f) && !_commit(_fileno(f));
+#endif
+	if (!synced || ferror(f)) {
+		perror(tmp_path);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+#ifndef WIN32
+	if (rename(tmp_path, path) == -1) {
+		perror("rename");
+		return false;
+	}
+#else
+	// a mapped file can't be replaced on Windows
+	for (auto &s : sections)
+		s.unmap();
+	mapping.reset();
+	if (!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+		fprintf(stderr, "%s: MoveFileEx failed (%lu)\n", path, GetLastError());
+		return false;
+	}
+#endif
+	return true;
+}
+}
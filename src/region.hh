@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#ifndef RSGAME_REGION
+#define RSGAME_REGION
+namespace rsgame {
+	// world file layout, see region.cc
+	enum {
+		REGION_VERSION = 2,
+		REGION_HEADER = 64,
+		REGION_UNIT = 64,
+		REGION_SCHED = 16,
+		// version 1 kept every section in a raw slot
+		REGION_SLOT = 6144,
+		REGION_CLASSES = 14,
+		// units the index entries can address
+		REGION_MAX_UNITS = 0x07FFFFFE,
+	};
+	// how many units a record of each size class takes
+	static const uint8_t region_class_units[REGION_CLASSES] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128};
+	// the smallest size class that fits len bytes
+	inline int region_class(size_t len) {
+		int c = 0;
+		while ((size_t)region_class_units[c]*REGION_UNIT < len)
+			c++;
+		return c;
+	}
+	inline uint32_t region_entry(int size_class, uint32_t unit) {
+		return (uint32_t)size_class << 27 | (unit + 1);
+	}
+	inline int region_entry_class(uint32_t e) {
+		return e >> 27 & 15;
+	}
+	inline uint32_t region_entry_unit(uint32_t e) {
+		return (e & 0x07FFFFFF) - 1;
+	}
+	inline size_t region_data_offset(size_t nsections) {
+		return (REGION_HEADER + nsections*4 + 4095) & ~(size_t)4095;
+	}
+	inline uint32_t get_le32(const uint8_t *p) {
+		return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+	}
+	inline uint64_t get_le64(const uint8_t *p) {
+		return get_le32(p) | (uint64_t)get_le32(p+4)<<32;
+	}
+	inline void put_le32(uint8_t *p, uint32_t x) {
+		p[0] = x;
+		p[1] = x>>8;
+		p[2] = x>>16;
+		p[3] = x>>24;
+	}
+	inline void put_le64(uint8_t *p, uint64_t x) {
+		put_le32(p, x);
+		put_le32(p+4, x>>32);
+	}
+	// scheduled update records, shared by world files and journals
+	inline void put_sched(uint8_t *p, uint32_t index, uint8_t id, long target_tick) {
+		memset(p, 0, REGION_SCHED);
+		put_le32(p, index);
+		p[4] = id;
+		put_le64(p+8, target_tick);
+	}
+}
+#endif
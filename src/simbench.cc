@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#include "common.hh"
+#include "level.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#ifndef WIN32
+#include <sys/resource.h>
+#else
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#undef near
+#undef far
+#undef min
+#undef max
+#endif
+namespace rsgame {
+void server_set_dirty(int, int, int) {
+}
+/* Headless simulation benchmark
+ * Builds each requested circuit into an empty level, lets it settle,
+ * then runs on_tick as fast as it can and prints the results as JSON.
+ * Circuits are named on the command line as name=size:
+ *   clocks  size*size torch clocks
+ *   line    a clock driving a line of size wires
+ *   grid    a clock driving a size*size wire grid
+ *   tower   a clock driving a tower of size torches
+ * --bfs-wires runs them with breadth_first_wires.
+ */
+struct Builder {
+	Level &level;
+	ivec3 lo = ivec3(INT_MAX), hi = ivec3(INT_MIN);
+	Builder(Level &level) :level(level) {}
+	void put(int x, int y, int z, uint8_t id, uint8_t metadata = 0) {
+		level.set_tile(x, y, z, id, metadata);
+		lo = ivec3(std::min(lo.x, x), std::min(lo.y, y), std::min(lo.z, z));
+		hi = ivec3(std::max(hi.x, x), std::max(hi.y, y), std::max(hi.z, z));
+	}
+	void add(int x, int y, int z, uint8_t id, uint8_t metadata = 0) {
+		put(x, y, z, id, metadata);
+		level.on_block_add(x, y, z, id);
+	}
+	// a torch on the side of a block, with a loop of wire from the
+	// torch back into the block. the torch is at x+1, 1, z
+	void clock(int x, int z) {
+		for (int i = -1; i < 5; i++)
+			for (int j = -1; j < 5; j++)
+				put(x+i, 0, z+j, 1);
+		put(x, 1, z, 1);
+		put(x+2, 1, z, 55);
+		put(x+2, 1, z+1, 55);
+		put(x+2, 1, z+2, 55);
+		put(x+1, 1, z+2, 55);
+		put(x, 1, z+2, 55);
+		put(x, 1, z+1, 55);
+		add(x+1, 1, z, 76, 1);
+	}
+	uint64_t hash() {
+		uint64_t h = 1469598103934665603ull;
+		for (int x = lo.x; x <= hi.x; x++)
+			for (int z = lo.z; z <= hi.z; z++)
+				for (int y = lo.y; y <= hi.y; y++) {
+					h = (h ^ level.get_tile_id(x, y, z)) * 1099511628211ull;
+					h = (h ^ level.get_tile_meta(x, y, z)) * 1099511628211ull;
+				}
+		return h;
+	}
+};
+struct Circuit {
+	const char *name;
+	int default_size, max_size;
+	// level size needed for a given circuit size
+	int (*xsize)(int n), (*zsize)(int n);
+	void (*build)(Builder &b, int n);
+};
+static const Circuit circuits[] = {
+	{"clocks", 20, 256,
+		[](int n) { return 16 + n*7; },
+		[](int n) { return 16 + n*7; },
+		[](Builder &b, int n) {
+			for (int i = 0; i < n; i++)
+				for (int j = 0; j < n; j++)
+					b.clock(8 + i*7, 8 + j*7);
+		}},
+	{"line", 1000, 60000,
+		[](int n) { return n + 24; },
+		[](int) { return 24; },
+		[](Builder &b, int n) {
+			b.clock(8, 8);
+			for (int x = 9; x < 9 + n; x++)
+				b.put(x, 0, 6, 1);
+			b.add(9, 1, 7, 55);
+			for (int x = 9; x < 9 + n - 1; x++)
+				b.add(x, 1, 6, 55);
+		}},
+	{"grid", 64, 1000,
+		[](int n) { return n + 24; },
+		[](int n) { return n + 24; },
+		[](Builder &b, int n) {
+			b.clock(8, n + 8);
+			b.add(9, 1, n + 7, 55);
+			for (int x = 9; x < 9 + n; x++)
+				for (int z = 7; z < 7 + n; z++) {
+					b.put(x, 0, z, 1);
+					b.add(x, 1, z, 55);
+				}
+		}},
+	{"tower", 60, 63,
+		[](int) { return 24; },
+		[](int) { return 24; },
+		[](Builder &b, int n) {
+			b.clock(8, 8);
+			for (int i = 1; i <= n; i++) {
+				b.add(8, i*2, 8, 76, 5);
+				b.put(8, i*2 + 1, 8, 1);
+			}
+		}},
+};
+static int bits_for(int n) {
+	int bits = 0;
+	while (1 << bits < n)
+		bits++;
+	return bits;
+}
+static long peak_rss_kb() {
+#ifndef WIN32
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return -1;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+#else
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return -1;
+	return pmc.PeakWorkingSetSize / 1024;
+#endif
+}
+static void usage() {
+	fprintf(stderr, "usage: rsgame-simbench [--ticks n] [--threads n] [--bfs-wires] [circuit[=size]]...\ncircuits:");
+	for (const Circuit &c : circuits)
+		fprintf(stderr, " %s (default %d)", c.name, c.default_size);
+	fprintf(stderr, "\n");
+}
+int main(int argc, char **argv) {
+	tiles::init();
+	int ticks = 1000, threads = 1;
+	bool bfs_wires = false;
+	std::vector<std::pair<const Circuit *, int>> runs;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--ticks") && i+1 < argc) {
+			ticks = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--threads") && i+1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bfs-wires")) {
+			bfs_wires = true;
+		} else {
+			const char *eq = strchr(argv[i], '=');
+			size_t len = eq ? eq - argv[i] : strlen(argv[i]);
+			const Circuit *found = nullptr;
+			for (const Circuit &c : circuits)
+				if (strlen(c.name) == len && !memcmp(c.name, argv[i], len))
+					found = &c;
+			if (!found) {
+				usage();
+				return 1;
+			}
+			int size = eq ? atoi(eq + 1) : found->default_size;
+			if (size < 1 || size > found->max_size) {
+				fprintf(stderr, "%s: size must be between 1 and %d\n", found->name, found->max_size);
+				return 1;
+			}
+			runs.emplace_back(found, size);
+		}
+	}
+	if (runs.empty())
+		for (const Circuit &c : circuits)
+			runs.emplace_back(&c, c.default_size);
+
+	printf("{\n\t\"ticks\": %d,\n\t\"threads\": %d,\n\t\"circuits\": [", ticks, threads);
+	for (size_t i = 0; i < runs.size(); i++) {
+		const Circuit &c = *runs[i].first;
+		int n = runs[i].second;
+		int xs = c.xsize(n), zs = c.zsize(n);
+		Level level(xs, zs, bits_for(zs));
+		level.set_sim_threads(threads);
+		level.breadth_first_wires = bfs_wires;
+		Builder b(level);
+		c.build(b, n);
+		for (int t = 0; t < 100; t++)
+			level.on_tick();
+		uint64_t reads = level.tile_reads, updates = level.updates_run;
+		uint64_t block_updates = level.block_updates, skipped = level.block_updates_skipped;
+		auto start = std::chrono::steady_clock::now();
+		for (int t = 0; t < ticks; t++)
+			level.on_tick();
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		printf("%s\n\t\t{\"name\": \"%s\", \"size\": %d, \"ticks_per_s\": %.1f, \"updates_per_tick\": %.1f, "
+			"\"block_updates_per_tick\": %.1f, \"duplicates_per_tick\": %.1f, "
+			"\"tile_reads_per_tick\": %.1f, \"hash\": \"%016llx\"}",
+			i ? "," : "", c.name, n, ticks / secs,
+			(double)(level.updates_run - updates) / ticks,
+			(double)(level.block_updates - block_updates) / ticks,
+			(double)(level.block_updates_skipped - skipped) / ticks,
+			(double)(level.tile_reads - reads) / ticks,
+			(unsigned long long)b.hash());
+		fflush(stdout);
+	}
+	printf("\n\t],\n\t\"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+	return 0;
+}
+}
+extern "C" int main(int argc, char** argv)
+{
+	return rsgame::main(argc, argv);
+}
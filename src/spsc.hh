@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#ifndef RSGAME_SPSC
+#define RSGAME_SPSC
+#include <atomic>
+#include <stddef.h>
+namespace rsgame {
+	/* Unbounded queue between one producer and one consumer thread,
+	 * without locks. Items go into blocks of N, and a new block is
+	 * linked in when the producer's block is full. An item is published
+	 * by the release store of its block's count, and the consumer frees
+	 * a block once it has taken everything from it and the next one
+	 * exists, at which point the producer is done with it.
+	 */
+	template<typename T, size_t N = 256>
+	struct SpscQueue {
+		SpscQueue() {
+			head = tail = new Block;
+		}
+		~SpscQueue() {
+			while (head) {
+				Block *next = head->next.load(std::memory_order_relaxed);
+				delete head;
+				head = next;
+			}
+		}
+		SpscQueue(const SpscQueue&) =delete;
+		SpscQueue &operator=(const SpscQueue&) =delete;
+		// producer only
+		void push(T item) {
+			size_t n = tail->count.load(std::memory_order_relaxed);
+			if (n == N) {
+				Block *b = new Block;
+				tail->next.store(b, std::memory_order_release);
+				tail = b;
+				n = 0;
+			}
+			tail->items[n] = std::move(item);
+			tail->count.store(n + 1, std::memory_order_release);
+		}
+		// consumer only
+		bool pop(T &item) {
+			if (read == N) {
+				Block *next = head->next.load(std::memory_order_acquire);
+				if (!next)
+					return false;
+				delete head;
+				head = next;
+				read = 0;
+			}
+			if (read == head->count.load(std::memory_order_acquire))
+				return false;
+			item = std::move(head->items[read++]);
+			return true;
+		}
+	private:
+		struct Block {
+			T items[N];
+			std::atomic<size_t> count{0};
+			std::atomic<Block*> next{nullptr};
+		};
+		// head is the consumer's, tail the producer's
+		Block *head, *tail;
+		size_t read = 0;
+	};
+}
+#endif
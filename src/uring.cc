@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#include "common.hh"
+#include "uring.hh"
+#ifdef RSGAME_HAVE_URING
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+namespace rsgame {
+Uring::~Uring() {
+	if (buf_ring)
+		munmap(buf_ring, buf_ring_size);
+	if (sqes)
+		munmap(sqes, sqes_size);
+	if (ring)
+		munmap(ring, ring_size);
+	if (fd != -1)
+		close(fd);
+}
+bool Uring::init(unsigned entries, unsigned cq_entries) {
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	// SINGLE_ISSUER came with the same kernel as multishot recv, so
+	// this fails with EINVAL on kernels that can't do what we need
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+		| IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	p.cq_entries = cq_entries;
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd == -1) {
+		perror("io_uring_setup");
+		return false;
+	}
+	unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((p.features & needed) != needed) {
+		fprintf(stderr, "io_uring: missing features\n");
+		return false;
+	}
+	ring_size = std::max(p.sq_off.array + p.sq_entries*sizeof(unsigned),
+		p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe));
+	ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		ring = nullptr;
+		perror("mmap");
+		return false;
+	}
+	sqes_size = p.sq_entries*sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		sqes = nullptr;
+		perror("mmap");
+		return false;
+	}
+	uint8_t *r = (uint8_t *)ring;
+	sq_khead = (unsigned *)(r + p.sq_off.head);
+	sq_ktail = (unsigned *)(r + p.sq_off.tail);
+	sq_mask = *(unsigned *)(r + p.sq_off.ring_mask);
+	sq_entries = p.sq_entries;
+	// sqes are always used in order
+	unsigned *array = (unsigned *)(r + p.sq_off.array);
+	for (unsigned i = 0; i < sq_entries; i++)
+		array[i] = i;
+	sq_tail = sq_submitted = *sq_ktail;
+	cq_khead = (unsigned *)(r + p.cq_off.head);
+	cq_tail = (unsigned *)(r + p.cq_off.tail);
+	cq_mask = *(unsigned *)(r + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(r + p.cq_off.cqes);
+	cq_head = *cq_khead;
+	return true;
+}
+bool Uring::provide_buffers(unsigned count, unsigned size) {
+	assert(count && !(count & (count-1)) && count <= 32768);
+	buf_ring_size = count*sizeof(io_uring_buf);
+	void *mem = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	buf_ring = (io_uring_buf *)mem;
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+	reg.ring_entries = count;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		perror("io_uring_register");
+		return false;
+	}
+	buffer_count = count;
+	buffer_size = size;
+	buffers.resize((size_t)count * size);
+	for (unsigned i = 0; i < count; i++)
+		return_buffer(i);
+	return true;
+}
+void Uring::return_buffer(uint16_t id) {
+	io_uring_buf &buf = buf_ring[buf_tail & (buffer_count-1)];
+	buf.addr = (uint64_t)(uintptr_t)buffer(id);
+	buf.len = buffer_size;
+	buf.bid = id;
+	__atomic_store_n(&((io_uring_buf_ring *)buf_ring)->tail, ++buf_tail, __ATOMIC_RELEASE);
+}
+io_uring_sqe *Uring::sqe() {
+	if (sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE) == sq_entries) {
+		enter(sq_tail - sq_submitted, false, 0);
+		if (sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE) == sq_entries)
+			return nullptr;
+	}
+	io_uring_sqe *sqe = &sqes[sq_tail++ & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+void Uring::submit(int timeout_ms) {
+	unsigned to_submit = sq_tail - sq_submitted;
+	bool ready = cqe();
+	if (!to_submit && ready)
+		return;
+	enter(to_submit, !ready, timeout_ms);
+}
+int Uring::enter(unsigned to_submit, bool wait, int timeout_ms) {
+	__atomic_store_n(sq_ktail, sq_tail, __ATOMIC_RELEASE);
+	sq_submitted = sq_tail;
+	__kernel_timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+	enters++;
+	int r = syscall(__NR_io_uring_enter, fd, to_submit, wait ? 1 : 0, flags,
+		wait ? &arg : nullptr, wait ? sizeof(arg) : 0);
+	if (r == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+		perror("io_uring_enter");
+	return r;
+}
+}
+#endif
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#ifndef RSGAME_URING
+#define RSGAME_URING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// multishot recv is the newest thing used here
+#ifdef IORING_RECV_MULTISHOT
+#define RSGAME_HAVE_URING
+#endif
+#endif
+#endif
+#ifdef RSGAME_HAVE_URING
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+namespace rsgame {
+	/* io_uring, talking to the kernel directly instead of through
+	 * liburing. It only does what the server needs: one submission
+	 * queue filled from one thread, and a single ring of provided
+	 * buffers (group 0) for IOSQE_BUFFER_SELECT recvs.
+	 */
+	struct Uring {
+		Uring() {}
+		~Uring();
+		Uring(const Uring&) =delete;
+		Uring &operator=(const Uring&) =delete;
+		// false if the kernel doesn't have io_uring or is too old for
+		// multishot recv
+		bool init(unsigned entries, unsigned cq_entries);
+		bool provide_buffers(unsigned count, unsigned size);
+		// a zeroed sqe, or null if the queue is full even after
+		// submitting what's in it
+		io_uring_sqe *sqe();
+		// submits queued sqes, and if there aren't any completions yet,
+		// waits up to timeout_ms for one
+		void submit(int timeout_ms);
+		io_uring_cqe *cqe() {
+			if (cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+				return nullptr;
+			return &cqes[cq_head & cq_mask];
+		}
+		void pop() {
+			__atomic_store_n(cq_khead, ++cq_head, __ATOMIC_RELEASE);
+		}
+		uint8_t *buffer(uint16_t id) {
+			return &buffers[(size_t)id * buffer_size];
+		}
+		void return_buffer(uint16_t id);
+		// io_uring_enter calls
+		uint64_t enters = 0;
+	private:
+		int fd = -1;
+		void *ring = nullptr;
+		size_t ring_size = 0;
+		io_uring_sqe *sqes = nullptr;
+		size_t sqes_size = 0;
+		unsigned *sq_khead, *sq_ktail;
+		unsigned sq_entries, sq_mask;
+		unsigned sq_tail = 0, sq_submitted = 0;
+		unsigned *cq_khead, *cq_tail;
+		unsigned cq_mask;
+		unsigned cq_head = 0;
+		io_uring_cqe *cqes;
+		// io_uring_buf_ring's bufs member is wrong in C++, where the
+		// empty struct in front of it takes up space
+		io_uring_buf *buf_ring = nullptr;
+		size_t buf_ring_size = 0;
+		unsigned buffer_count = 0, buffer_size = 0;
+		uint16_t buf_tail = 0;
+		std::vector<uint8_t> buffers;
+		int enter(unsigned to_submit, bool wait, int timeout_ms);
+	};
+}
+#endif
+#endif
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+#include "common.hh"
+#include "level.hh"
+#include <stdio.h>
+namespace rsgame {
+void server_set_dirty(int, int, int) {
+}
+}
+using namespace rsgame;
+/* C_ChangeBlock indices are whatever the client sent, so the server checks
+ * them with Level::is_block before applying them. Ones that don't fall in
+ * the level are air as far as get_tile_id is concerned, and have to be
+ * rejected anyway.
+ */
+static int failures = 0;
+static void expect(bool ok, const char *what) {
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		failures++;
+	}
+}
+// the C_ChangeBlock index, without pos_to_index's bounds check
+static uint32_t raw_index(const Level &level, int x, int y, int z) {
+	return (uint32_t)x << (level.zbits+7) | (uint32_t)z << 7 | y;
+}
+int main() {
+	tiles::init();
+	Level level(512, 300, 9);
+	level.set_tile(10, 64, 10, 1, 0);
+	expect(level.is_block(raw_index(level, 10, 64, 10), 1, 0), "stone in the level");
+	expect(!level.is_block(raw_index(level, 10, 64, 10), 0, 0), "air where there is stone");
+	expect(level.is_block(raw_index(level, 510, 100, 8), 0, 0), "air in the level");
+	expect(!level.is_block(raw_index(level, 600, 100, 8), 0, 0), "x past the edge");
+	expect(!level.is_block(raw_index(level, 8, 100, 400), 0, 0), "z past the edge");
+	expect(!level.is_block((uint32_t)-1, 0, 0), "index -1");
+	// nothing was changed by looking
+	expect(level.get_tile_id(10, 64, 10) == 1, "stone is still there");
+	if (!failures)
+		fprintf(stderr, "edits: ok\n");
+	return failures != 0;
+}